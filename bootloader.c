@@ -24,6 +24,7 @@
 #include <string.h>
 
 #include <RP2040.h>
+#include <hardware/clocks.h>
 #include <hardware/flash.h>
 #include <hardware/resets.h>
 #include <hardware/sync.h>
@@ -33,58 +34,1088 @@
 
 #include "linker_common/linker_definitions.h"
 
-#ifdef PFB_WITH_BOOTLOADER_LOGS
-#    define BOOTLOADER_LOG(...)                \
-        do {                                   \
-            puts("[BOOTLOADER] " __VA_ARGS__); \
-            sleep_ms(5);                       \
+#if defined(PFB_REDIRECT_BOOTLOADER_LOGS_TO_RAM)
+/**
+ * Records are written into the RAM shared with the application, which reads
+ * them using @ref pfb_read_bootloader_log, so logging causes no I/O waits.
+ */
+#    define BOOTLOADER_LOG(...) _pfb_log_to_ram("[BOOTLOADER] " __VA_ARGS__)
+#elif defined(PFB_WITH_BOOTLOADER_LOGS)
+/**
+ * Set once stdio has been initialized, which (if @ref PFB_WITH_FAST_BOOT is
+ * defined) happens only if an update or a rollback is pending.
+ */
+static bool g_is_logging_enabled;
+
+#    define BOOTLOADER_LOG(...)                      \
+        do {                                         \
+            if (g_is_logging_enabled) {              \
+                printf("[BOOTLOADER] " __VA_ARGS__); \
+                puts("");                            \
+                sleep_ms(5);                         \
+            }                                        \
         } while (0)
-#else // PFB_WITH_BOOTLOADER_LOGS
+#else
 #    define BOOTLOADER_LOG(...) ((void) 0)
-#endif // PFB_WITH_BOOTLOADER_LOGS
+#endif
+
+#ifdef PFB_WITH_BLOCK_SWAP
+#    define PFB_SWAP_CHUNK_SIZE FLASH_BLOCK_SIZE
+#else // PFB_WITH_BLOCK_SWAP
+#    define PFB_SWAP_CHUNK_SIZE FLASH_SECTOR_SIZE
+#endif // PFB_WITH_BLOCK_SWAP
+
+#if defined(PFB_WITH_DIRECT_XIP)                \
+        && (defined(PFB_WITH_OVERWRITE_ONLY_UPDATE) \
+            || defined(PFB_WITH_IMAGE_COMPRESSION))
+#    error "PFB_WITH_DIRECT_XIP can't be used with PFB_WITH_OVERWRITE_ONLY_UPDATE nor PFB_WITH_IMAGE_COMPRESSION"
+#endif
+
+#define PFB_SWAP_JOURNAL_MAGIC 0x4a524e4c
+#define PFB_SWAP_JOURNAL_STEP_DONE 0x00
+
+#define PFB_SHA256_DIGEST_SIZE 32
+
+/**
+ * PFB_BOOT_COMMAND_* commands passed by the application for the current boot,
+ * see @ref pfb_reboot.
+ */
+static uint32_t g_boot_commands;
+
+/**
+ * Statistics of the current boot, located in the RAM shared with the
+ * application, see @ref pfb_get_boot_stats.
+ */
+static pfb_boot_stats_t *g_boot_stats;
+
+#ifndef PFB_WITH_DIRECT_XIP
+/**
+ * Chunk buffer is kept in the uninitialized RAM section, so it neither
+ * occupies the (small) stack nor has to be zeroed during the startup.
+ */
+static uint8_t __uninitialized_ram(g_chunk_buff)[PFB_SWAP_CHUNK_SIZE];
+#endif // PFB_WITH_DIRECT_XIP
 
-void _pfb_mark_pico_has_new_firmware(void);
 void _pfb_mark_pico_has_no_new_firmware(void);
-void _pfb_mark_is_after_rollback(void);
-void _pfb_mark_is_not_after_rollback(void);
 bool _pfb_should_rollback(void);
-void _pfb_mark_should_rollback(void);
+uint32_t _pfb_get_trial_boots_count(void);
+void _pfb_mark_trial_boot(void);
 bool _pfb_has_firmware_to_swap(void);
+uint32_t _pfb_get_app_image_length(void);
+uint32_t _pfb_get_download_image_length(void);
+uint32_t _pfb_get_app_slot_addr(void);
+uint32_t _pfb_get_download_slot_addr(void);
+uint32_t _pfb_get_swap_counter(void);
+uint32_t _pfb_get_app_image_backup_length(void);
+bool _pfb_is_compressed_file_length_valid(uint32_t file_length);
+void _pfb_mark_firmware_copied(uint32_t app_image_length);
+void _pfb_mark_firmware_swapped(bool is_invalid);
+void _pfb_mark_firmware_unpacked(uint32_t app_image_length,
+                                 uint32_t download_image_length,
+                                 bool is_invalid);
+void _pfb_mark_firmware_rolled_back(void);
+void _pfb_start_image_hashing(void);
+void _pfb_update_image_hash(const uint8_t *data, size_t len);
+bool _pfb_is_image_hash_valid(const uint8_t *image_sha256);
+pfb_boot_stats_t *_pfb_initialize_shared_ram(void);
+void _pfb_initialize_info_partition(void);
+uint32_t _pfb_consume_boot_commands(void);
+void _pfb_begin_info_transaction(void);
+void _pfb_commit_info_transaction(void);
+void _pfb_log_to_ram(const char *format, ...);
+void _pfb_add_update_history_entry(const pfb_update_history_entry_t *entry);
+void _pfb_store_wear_stats(void);
+void _pfb_set_swap_skipped_sectors(uint32_t skipped_sectors);
+bool _pfb_is_flash_sector_erased(uint32_t addr);
+void _pfb_erase_flash_range(uint32_t addr, size_t len);
+void _pfb_program_flash_range(uint32_t addr, const uint8_t *src, size_t len);
+
+static uint32_t get_elapsed_time_us(uint64_t start_us) {
+    return (uint32_t) (time_us_64() - start_us);
+}
+
+#ifndef PFB_WITH_OVERWRITE_ONLY_UPDATE
+static void boot_uncommitted_firmware(void) {
+    if (g_boot_commands & PFB_BOOT_COMMAND_TRIAL_BOOT) {
+        BOOTLOADER_LOG("Uncommitted firmware, reboot requested by it");
+        return;
+    }
+    BOOTLOADER_LOG("Uncommitted firmware, boot attempt %lu of %d",
+                   (unsigned long) _pfb_get_trial_boots_count() + 1,
+                   PFB_TRIAL_BOOTS_COUNT);
+    _pfb_mark_trial_boot();
+}
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+
+/**
+ * Fills the versions of the update history entry. MUST be called before the
+ * update, as it swaps the image descriptors.
+ */
+static void start_update_history_entry(pfb_update_history_entry_t *entry) {
+    pfb_image_descriptor_t app_descriptor;
+    pfb_image_descriptor_t download_descriptor;
+
+    pfb_get_app_image_descriptor(&app_descriptor);
+    pfb_get_download_image_descriptor(&download_descriptor);
+
+    // the download slot holds either the new image or, in case of the
+    // rollback, the previous one
+    entry->from_version = app_descriptor.version;
+    entry->from_build_id = app_descriptor.build_id;
+    entry->to_version = download_descriptor.version;
+    entry->to_build_id = download_descriptor.build_id;
+}
+
+/**
+ * Clears the flags of the downloaded image using a single write of the flash
+ * info partition, so a power loss never leaves only one of them cleared.
+ */
+static void discard_downloaded_image(void) {
+    _pfb_begin_info_transaction();
+    _pfb_mark_pico_has_no_new_firmware();
+    pfb_mark_download_slot_as_invalid();
+    _pfb_commit_info_transaction();
+}
+
+/**
+ * Checks if the security counter of the downloaded image is lower than the
+ * device's one, i.e. if the image is an older release that MUST NOT be
+ * installed anymore.
+ */
+static bool is_download_image_downgrade(void) {
+    pfb_image_descriptor_t descriptor;
+
+    pfb_get_download_image_descriptor(&descriptor);
+    return descriptor.security_counter < pfb_get_security_counter();
+}
+
+#ifdef PFB_WITH_DIRECT_XIP
+/**
+ * Checks if the downloaded image can be executed in place, i.e. if it has been
+ * linked for the slot it has been downloaded into and if its SHA256 is valid.
+ */
+static bool is_download_image_valid(void) {
+    uint32_t slot_addr = _pfb_get_download_slot_addr();
+    uint32_t image_length = _pfb_get_download_image_length();
+    // the reset handler is the second entry of the vector table
+    uint32_t reset_handler = ((const uint32_t *) slot_addr)[1];
+
+    return reset_handler >= slot_addr
+           && reset_handler
+                      < slot_addr + PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH)
+           && (!image_length || pfb_firmware_sha256_check(image_length) == 0);
+}
+#else  // PFB_WITH_DIRECT_XIP
+/**
+ * Outcome of installing the downloaded image, recorded in the update history.
+ */
+typedef enum {
+    PFB_INSTALL_RESULT_INSTALLED,
+    /** The image has been discarded before the application slot was touched. */
+    PFB_INSTALL_RESULT_REJECTED,
+    /** The image is invalid, so the previous one has to be restored. */
+    PFB_INSTALL_RESULT_REVERT_REQUIRED
+} pfb_install_result_t;
+
+static uint32_t align_to_sector_size(uint32_t length) {
+    return (length + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE
+           * FLASH_SECTOR_SIZE;
+}
+
+#ifdef PFB_WITH_OVERWRITE_ONLY_UPDATE
+/**
+ * Returns the number of bytes that have to be copied from the download slot,
+ * i.e. the length of the downloaded image rounded up to the flash sector size.
+ * If the length is unknown, the maximum image length is used.
+ */
+static uint32_t get_copy_length(void) {
+    uint32_t image_max_length = PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH);
+    uint32_t download_image_length = _pfb_get_download_image_length();
+
+    if (!download_image_length) {
+        return image_max_length;
+    }
+
+    return MIN(align_to_sector_size(download_image_length), image_max_length);
+}
+#else  // PFB_WITH_OVERWRITE_ONLY_UPDATE
+/**
+ * Returns the number of bytes that have to be swapped so that both images are
+ * moved entirely, i.e. the length of the bigger image rounded up to the flash
+ * sector size. If any of the lengths is unknown (e.g. the application has been
+ * flashed directly, without an update), the maximum image length is used.
+ */
+static uint32_t get_swap_length(void) {
+    uint32_t image_max_length = PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH);
+    uint32_t app_image_length = _pfb_get_app_image_length();
+    uint32_t download_image_length = _pfb_get_download_image_length();
+
+    if (!app_image_length || !download_image_length) {
+        return image_max_length;
+    }
+
+    uint32_t swap_length = MAX(app_image_length, download_image_length);
+
+    return MIN(align_to_sector_size(swap_length), image_max_length);
+}
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+
+/**
+ * Returns the length of the next chunk to be processed. Chunks are aligned to
+ * the application slot's 64k blocks (if @ref PFB_WITH_BLOCK_SWAP is defined) or
+ * to the flash sectors, so the first and the last chunk may be shorter. Note
+ * that the download slot is not 64k aligned relative to the application slot,
+ * so the ROM erase routine falls back to 4k sector erases on that side.
+ */
+static uint32_t get_chunk_length(uint32_t offset, uint32_t length) {
+    uint32_t app_offset =
+            PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_APP_START) + offset;
+    uint32_t chunk_length =
+            PFB_SWAP_CHUNK_SIZE - app_offset % PFB_SWAP_CHUNK_SIZE;
+
+    return MIN(chunk_length, length - offset);
+}
+
+static void
+write_flash_run(uint32_t dst_addr, const uint8_t *src, uint32_t len) {
+    // already erased sectors are not erased again and erased pages are not
+    // programmed, which is the case for the tails of both images
+    _pfb_erase_flash_range(dst_addr, len);
+    _pfb_program_flash_range(dst_addr, src, len);
+}
+
+/**
+ * Writes @p len bytes from the RAM into the flash, skipping the sectors that
+ * already have the same content. Consecutive changed sectors are written
+ * together. Thanks to that, repeating the write that has been interrupted by a
+ * power loss is cheap.
+ *
+ * @return Number of skipped sectors.
+ */
+static uint32_t
+write_flash_range(uint32_t dst_addr, const uint8_t *src, uint32_t len) {
+    uint32_t skipped_sectors = 0;
+    uint32_t range_start = 0;
+
+    for (uint32_t sector = 0; sector < len; sector += FLASH_SECTOR_SIZE) {
+        if (memcmp((void *) (dst_addr + sector), src + sector,
+                   FLASH_SECTOR_SIZE)
+            == 0) {
+            write_flash_run(dst_addr + range_start, src + range_start,
+                            sector - range_start);
+            range_start = sector + FLASH_SECTOR_SIZE;
+            skipped_sectors++;
+        }
+    }
+    write_flash_run(dst_addr + range_start, src + range_start,
+                    len - range_start);
+
+    return skipped_sectors;
+}
+
+/**
+ * Copies @p len bytes (at most @ref PFB_SWAP_CHUNK_SIZE) between the flash
+ * areas through the chunk buffer, see @ref write_flash_range.
+ *
+ * @return Number of skipped sectors.
+ */
+static uint32_t
+copy_flash_range(uint32_t dst_addr, uint32_t src_addr, uint32_t len) {
+    uint64_t copy_start_us = time_us_64();
+    memcpy(g_chunk_buff, (void *) src_addr, len);
+    g_boot_stats->copy_time_us += get_elapsed_time_us(copy_start_us);
+
+    return write_flash_range(dst_addr, g_chunk_buff, len);
+}
+
+#ifdef PFB_WITH_OVERWRITE_ONLY_UPDATE
+static bool is_download_image_valid(void) {
+    uint32_t image_length = _pfb_get_download_image_length();
+
+    return !image_length || pfb_firmware_sha256_check(image_length) == 0;
+}
+
+/**
+ * Copies the download slot into the application slot. The download slot stays
+ * untouched, so the copy can be safely restarted after a power loss.
+ *
+ * @return Number of sectors skipped because of the same content in both slots.
+ */
+static uint32_t overwrite_app_image(uint32_t copy_length) {
+    __unused uint64_t copy_start_us = time_us_64();
+    uint32_t skipped_sectors = 0;
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    uint32_t chunk_length;
+    for (uint32_t offset = 0; offset < copy_length; offset += chunk_length) {
+        chunk_length = get_chunk_length(offset, copy_length);
+        skipped_sectors += copy_flash_range(
+                PFB_ADDR_AS_U32(__FLASH_APP_START) + offset,
+                PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START) + offset,
+                chunk_length);
+    }
+    restore_interrupts(saved_interrupts);
 
-static void swap_images(void) {
-    uint8_t swap_buff_from_downlaod_slot[FLASH_SECTOR_SIZE];
-    uint8_t swap_buff_from_application_slot[FLASH_SECTOR_SIZE];
-    const uint32_t SWAP_ITERATIONS =
-            PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH) / FLASH_SECTOR_SIZE;
+    BOOTLOADER_LOG("Copied %lu bytes (%lu unchanged sectors skipped) in "
+                   "%lu ms",
+                   (unsigned long) copy_length, (unsigned long) skipped_sectors,
+                   (unsigned long) ((time_us_64() - copy_start_us) / 1000));
+
+    return skipped_sectors;
+}
+#else  // PFB_WITH_OVERWRITE_ONLY_UPDATE
+/**
+ * Every swapped sector goes through the following steps. None of them
+ * modifies its own source, so each step can be repeated after a power loss.
+ */
+typedef enum {
+    PFB_SWAP_STEP_APP_TO_SCRATCH,
+    PFB_SWAP_STEP_DOWNLOAD_TO_APP,
+    PFB_SWAP_STEP_SCRATCH_TO_DOWNLOAD,
+    PFB_SWAP_STEPS_COUNT
+} pfb_swap_step_t;
+
+/**
+ * The swap journal occupies a single flash sector. The first page contains the
+ * header, which ties the journal to the swap counter stored in the flash info
+ * partition. Each of the next pages corresponds to a swap step and contains
+ * one byte per flash sector of the slot, programmed to
+ * @ref PFB_SWAP_JOURNAL_STEP_DONE once the step is finished for the sector.
+ * Flash bits can be cleared without erasing, so recording the progress never
+ * erases the journal.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t swap_counter;
+    uint32_t swap_length;
+    uint32_t backup_length;
+} pfb_swap_journal_header_t;
+
+static bool is_sector_unchanged(uint32_t offset) {
+    return memcmp((void *) (PFB_ADDR_AS_U32(__FLASH_APP_START) + offset),
+                  (void *) (PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START)
+                            + offset),
+                  FLASH_SECTOR_SIZE)
+           == 0;
+}
+
+static uint32_t get_journal_step_page_addr(uint32_t step) {
+    return PFB_ADDR_AS_U32(__FLASH_SWAP_JOURNAL_START)
+           + (step + 1) * FLASH_PAGE_SIZE;
+}
+
+static const pfb_swap_journal_header_t *get_journal_header(void) {
+    return (const pfb_swap_journal_header_t *) PFB_ADDR_AS_U32(
+            __FLASH_SWAP_JOURNAL_START);
+}
+
+/**
+ * The journal is valid only for the operation identified by @p magic and
+ * @p swap_length that has been started since the last swap counter increment.
+ */
+static bool is_journal_valid(uint32_t magic, uint32_t swap_length) {
+    const pfb_swap_journal_header_t *header = get_journal_header();
+
+    return header->magic == magic
+           && header->swap_counter == _pfb_get_swap_counter()
+           && header->swap_length == swap_length;
+}
+
+static void
+start_journal(uint32_t magic, uint32_t swap_length, uint32_t backup_length) {
+    uint8_t header_page[FLASH_PAGE_SIZE];
+    pfb_swap_journal_header_t header = {
+        .magic = magic,
+        .swap_counter = _pfb_get_swap_counter(),
+        .swap_length = swap_length,
+        .backup_length = backup_length
+    };
+
+    memset(header_page, 0xFF, sizeof(header_page));
+    memcpy(header_page, &header, sizeof(header));
+    _pfb_erase_flash_range(PFB_ADDR_AS_U32(__FLASH_SWAP_JOURNAL_START),
+                           FLASH_SECTOR_SIZE);
+    _pfb_program_flash_range(PFB_ADDR_AS_U32(__FLASH_SWAP_JOURNAL_START),
+                             header_page, FLASH_PAGE_SIZE);
+}
+
+static uint8_t get_sector_steps_done(uint32_t sector_index) {
+    uint8_t steps_done = 0;
+
+    while (steps_done < PFB_SWAP_STEPS_COUNT
+           && *(const uint8_t *) (get_journal_step_page_addr(steps_done)
+                                  + sector_index)
+                      == PFB_SWAP_JOURNAL_STEP_DONE) {
+        steps_done++;
+    }
+    return steps_done;
+}
+
+/**
+ * Returns the scratch address for the slot offset. The position inside the
+ * scratch follows the position inside the application slot's 64k block, so the
+ * scratch wear is spread evenly and a whole 64k chunk fits in the scratch.
+ */
+static uint32_t get_scratch_addr(uint32_t offset) {
+    uint32_t app_offset =
+            PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_APP_START) + offset;
+
+    return PFB_ADDR_AS_U32(__FLASH_SWAP_SCRATCH_START)
+           + app_offset % FLASH_BLOCK_SIZE;
+}
+
+static void
+perform_swap_step(pfb_swap_step_t step, uint32_t offset, uint32_t length) {
+    uint32_t app_addr = PFB_ADDR_AS_U32(__FLASH_APP_START) + offset;
+    uint32_t download_slot_addr =
+            PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START) + offset;
+    uint32_t scratch_addr = get_scratch_addr(offset);
+
+    switch (step) {
+    case PFB_SWAP_STEP_APP_TO_SCRATCH:
+        copy_flash_range(scratch_addr, app_addr, length);
+        break;
+    case PFB_SWAP_STEP_DOWNLOAD_TO_APP:
+        copy_flash_range(app_addr, download_slot_addr, length);
+        break;
+    case PFB_SWAP_STEP_SCRATCH_TO_DOWNLOAD:
+        copy_flash_range(download_slot_addr, scratch_addr, length);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Swaps the chunk step by step, continuing from the progress recorded in the
+ * swap journal. Every step is recorded only after it has been finished for all
+ * of the chunk's sectors, so the next step never starts before the previous
+ * one is recorded.
+ *
+ * @return Number of sectors skipped because of the same content in both slots.
+ */
+static uint32_t swap_chunk(uint32_t offset, uint32_t chunk_length) {
+    uint8_t steps_done[PFB_SWAP_CHUNK_SIZE / FLASH_SECTOR_SIZE];
+    uint32_t first_sector_index = offset / FLASH_SECTOR_SIZE;
+    uint32_t sectors_count = chunk_length / FLASH_SECTOR_SIZE;
+    uint32_t skipped_sectors = 0;
+
+    for (uint32_t i = 0; i < sectors_count; i++) {
+        steps_done[i] = get_sector_steps_done(first_sector_index + i);
+        // slots can be compared only if the sector swap has not been started
+        if (!steps_done[i] && is_sector_unchanged(i * FLASH_SECTOR_SIZE
+                                                  + offset)) {
+            steps_done[i] = PFB_SWAP_STEPS_COUNT;
+            skipped_sectors++;
+        }
+    }
+
+    for (int step = 0; step < PFB_SWAP_STEPS_COUNT; step++) {
+        uint8_t journal_page[FLASH_PAGE_SIZE];
+        uint32_t range_start = 0;
+
+        memset(journal_page, 0xFF, sizeof(journal_page));
+        for (uint32_t i = 0; i < sectors_count; i++) {
+            if (steps_done[i] == step) {
+                journal_page[first_sector_index + i] =
+                        PFB_SWAP_JOURNAL_STEP_DONE;
+                steps_done[i]++;
+                continue;
+            }
+            perform_swap_step(step, range_start * FLASH_SECTOR_SIZE + offset,
+                              (i - range_start) * FLASH_SECTOR_SIZE);
+            range_start = i + 1;
+        }
+        perform_swap_step(step, range_start * FLASH_SECTOR_SIZE + offset,
+                          (sectors_count - range_start) * FLASH_SECTOR_SIZE);
+        _pfb_program_flash_range(get_journal_step_page_addr(step),
+                                 journal_page, FLASH_PAGE_SIZE);
+    }
+
+    return skipped_sectors;
+}
+
+/**
+ * Returns the number of bytes of the downloaded image covered by its SHA256,
+ * i.e. the image without the appended 256 bytes, or 0 if the image length is
+ * unknown and the image can't be verified.
+ */
+static uint32_t get_hashed_length(uint32_t image_length) {
+    return image_length >= PFB_ALIGN_SIZE ? image_length - PFB_ALIGN_SIZE : 0;
+}
+
+/**
+ * Verifies the new image, which has been hashed while being swapped into the
+ * application slot, against the SHA256 stored in its last 32 bytes. Always
+ * succeeds if the image length is unknown or SHA256 hashing is disabled.
+ */
+static bool is_swapped_image_valid(uint32_t image_length) {
+    if (!get_hashed_length(image_length)) {
+        return true;
+    }
+
+    return _pfb_is_image_hash_valid(
+            (const uint8_t *) (PFB_ADDR_AS_U32(__FLASH_APP_START)
+                               + image_length - PFB_SHA256_DIGEST_SIZE));
+}
+
+/**
+ * Swaps the images using the swap scratch. The progress is recorded in the swap
+ * journal, so a swap interrupted by a power loss is resumed during the next
+ * boot. The journal stays valid until the swap counter in the flash info
+ * partition is incremented.
+ *
+ * The first @p hashed_length bytes of the new image are hashed right after each
+ * chunk is swapped, including the chunks skipped or swapped before a power
+ * loss, so the result can be checked using @ref is_swapped_image_valid.
+ *
+ * @return Number of sectors skipped because of the same content in both slots.
+ */
+static uint32_t swap_images(uint32_t swap_length, uint32_t hashed_length) {
+    __unused uint64_t swap_start_us = time_us_64();
+    uint32_t skipped_sectors = 0;
+
+    if (is_journal_valid(PFB_SWAP_JOURNAL_MAGIC, swap_length)) {
+        BOOTLOADER_LOG("Resuming the interrupted swap");
+    } else {
+        start_journal(PFB_SWAP_JOURNAL_MAGIC, swap_length, 0);
+    }
+
+    if (hashed_length) {
+        _pfb_start_image_hashing();
+    }
 
     uint32_t saved_interrupts = save_and_disable_interrupts();
-    for (uint32_t i = 0; i < SWAP_ITERATIONS; i++) {
-        memcpy(swap_buff_from_downlaod_slot,
-               (void *) (PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START)
-                         + i * FLASH_SECTOR_SIZE),
-               FLASH_SECTOR_SIZE);
-        memcpy(swap_buff_from_application_slot,
-               (void *) (PFB_ADDR_AS_U32(__FLASH_APP_START)
-                         + i * FLASH_SECTOR_SIZE),
-               FLASH_SECTOR_SIZE);
-        flash_range_erase(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_APP_START)
-                                  + i * FLASH_SECTOR_SIZE,
-                          FLASH_SECTOR_SIZE);
-        flash_range_erase(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(
-                                  __FLASH_DOWNLOAD_SLOT_START)
-                                  + i * FLASH_SECTOR_SIZE,
-                          FLASH_SECTOR_SIZE);
-        flash_range_program(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_APP_START)
-                                    + i * FLASH_SECTOR_SIZE,
-                            swap_buff_from_downlaod_slot,
-                            FLASH_SECTOR_SIZE);
-        flash_range_program(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(
-                                    __FLASH_DOWNLOAD_SLOT_START)
-                                    + i * FLASH_SECTOR_SIZE,
-                            swap_buff_from_application_slot,
-                            FLASH_SECTOR_SIZE);
+    uint32_t chunk_length;
+    for (uint32_t offset = 0; offset < swap_length; offset += chunk_length) {
+        chunk_length = get_chunk_length(offset, swap_length);
+        skipped_sectors += swap_chunk(offset, chunk_length);
+        if (offset < hashed_length) {
+            _pfb_update_image_hash(
+                    (const uint8_t *) (PFB_ADDR_AS_U32(__FLASH_APP_START)
+                                       + offset),
+                    MIN(chunk_length, hashed_length - offset));
+        }
     }
     restore_interrupts(saved_interrupts);
+
+    BOOTLOADER_LOG("Swapped %lu bytes (%lu unchanged sectors skipped) in "
+                   "%lu ms",
+                   (unsigned long) swap_length, (unsigned long) skipped_sectors,
+                   (unsigned long) ((time_us_64() - swap_start_us) / 1000));
+
+    return skipped_sectors;
+}
+
+/**
+ * Checks if the rollback, or the revert of an invalid new image, has been
+ * interrupted by a power loss. The swap journal of the update itself is
+ * invalidated by the record marking the firmware as swapped, so a valid journal
+ * of the uncommitted firmware belongs to the swap back.
+ */
+static bool is_rollback_interrupted(void) {
+    return _pfb_should_rollback()
+           && is_journal_valid(PFB_SWAP_JOURNAL_MAGIC, get_swap_length());
+}
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+
+#ifdef PFB_WITH_IMAGE_COMPRESSION
+#    define PFB_COMPRESSED_IMAGE_MAGIC 0x5a424650
+#    define PFB_DELTA_IMAGE_MAGIC 0x44424650
+#    define PFB_UNPACK_JOURNAL_MAGIC 0x4b504e55
+#    define PFB_LZ4_MIN_MATCH 4
+
+/**
+ * Header of the compressed image, see scripts/compress_image.py. It is followed
+ * by @p data_length bytes of the image compressed using the LZ4 block format.
+ *
+ * Delta images (see scripts/delta_image.py) use the same format, but a match
+ * with a zero offset is followed by a 24-bit position in the base image, i.e.
+ * the current application image identified by @p base_length and
+ * @p base_sha256.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t image_length;
+    uint32_t data_length;
+    uint32_t base_length;
+    uint8_t base_sha256[PFB_SHA256_DIGEST_SIZE];
+} pfb_compressed_image_header_t;
+
+typedef struct {
+    const uint8_t *in;
+    const uint8_t *in_end;
+    uint32_t out_pos;
+    uint32_t out_length;
+    uint32_t chunk_start;
+    uint32_t chunk_length;
+    uint32_t hashed_length;
+    const uint8_t *base;
+    uint32_t base_length;
+} pfb_unpack_ctx_t;
+
+static bool is_compressed_image_header_valid(
+        const pfb_compressed_image_header_t *header, uint32_t file_length) {
+    bool is_magic_valid = header->magic == PFB_COMPRESSED_IMAGE_MAGIC
+                                  ? !header->base_length
+                                  : header->magic == PFB_DELTA_IMAGE_MAGIC;
+
+    return file_length >= sizeof(*header) && is_magic_valid
+           && header->image_length
+           && header->image_length % PFB_ALIGN_SIZE == 0
+           && header->image_length <= PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH)
+           && header->data_length <= file_length - sizeof(*header);
+}
+
+static uint32_t get_unpacked_area_length(const pfb_unpack_ctx_t *ctx) {
+    return align_to_sector_size(ctx->out_length);
+}
+
+static void flush_unpacked_chunk(pfb_unpack_ctx_t *ctx) {
+    uint32_t app_addr = PFB_ADDR_AS_U32(__FLASH_APP_START) + ctx->chunk_start;
+
+    write_flash_range(app_addr, g_chunk_buff, ctx->chunk_length);
+    if (ctx->chunk_start < ctx->hashed_length) {
+        _pfb_update_image_hash((const uint8_t *) app_addr,
+                               MIN(ctx->chunk_length,
+                                   ctx->hashed_length - ctx->chunk_start));
+    }
+    ctx->chunk_start += ctx->chunk_length;
+    ctx->chunk_length = get_chunk_length(ctx->chunk_start,
+                                         get_unpacked_area_length(ctx));
+}
+
+static bool put_unpacked_byte(pfb_unpack_ctx_t *ctx, uint8_t byte) {
+    if (ctx->out_pos >= get_unpacked_area_length(ctx)) {
+        return false;
+    }
+
+    g_chunk_buff[ctx->out_pos++ - ctx->chunk_start] = byte;
+    if (ctx->out_pos == ctx->chunk_start + ctx->chunk_length) {
+        flush_unpacked_chunk(ctx);
+    }
+    return true;
+}
+
+static uint8_t get_unpacked_byte(const pfb_unpack_ctx_t *ctx, uint32_t pos) {
+    if (pos >= ctx->chunk_start) {
+        return g_chunk_buff[pos - ctx->chunk_start];
+    }
+    return *(const uint8_t *) (PFB_ADDR_AS_U32(__FLASH_APP_START) + pos);
+}
+
+static bool read_sequence_length(pfb_unpack_ctx_t *ctx, uint32_t *length) {
+    uint8_t byte;
+
+    if (*length != 0x0F) {
+        return true;
+    }
+
+    do {
+        if (ctx->in == ctx->in_end) {
+            return false;
+        }
+        byte = *ctx->in++;
+        *length += byte;
+    } while (byte == 0xFF);
+
+    return true;
+}
+
+/**
+ * Copies the match from the base image, which is possible only for delta
+ * images.
+ */
+static bool unpack_base_match(pfb_unpack_ctx_t *ctx, uint32_t length) {
+    if (ctx->in_end - ctx->in < 3) {
+        return false;
+    }
+
+    uint32_t base_pos =
+            ctx->in[0] | (ctx->in[1] << 8) | ((uint32_t) ctx->in[2] << 16);
+    ctx->in += 3;
+    if (!read_sequence_length(ctx, &length)) {
+        return false;
+    }
+    length += PFB_LZ4_MIN_MATCH;
+    if (base_pos > ctx->base_length || length > ctx->base_length - base_pos) {
+        return false;
+    }
+
+    for (; length; length--) {
+        if (ctx->out_pos >= ctx->out_length
+            || !put_unpacked_byte(ctx, ctx->base[base_pos++])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Decodes the LZ4 block. Matches refer to the already unpacked data, which is
+ * either in the chunk buffer or, for the previous chunks, already written into
+ * the application slot, so no separate window buffer is needed.
+ */
+static bool unpack_lz4_block(pfb_unpack_ctx_t *ctx) {
+    while (ctx->in < ctx->in_end) {
+        uint8_t token = *ctx->in++;
+        uint32_t length = token >> 4;
+
+        if (!read_sequence_length(ctx, &length)
+            || length > (uint32_t) (ctx->in_end - ctx->in)) {
+            return false;
+        }
+        for (; length; length--) {
+            if (ctx->out_pos >= ctx->out_length
+                || !put_unpacked_byte(ctx, *ctx->in++)) {
+                return false;
+            }
+        }
+
+        // the last sequence contains only literals
+        if (ctx->in == ctx->in_end) {
+            break;
+        }
+        if (ctx->in_end - ctx->in < 2) {
+            return false;
+        }
+
+        uint32_t offset = ctx->in[0] | (ctx->in[1] << 8);
+        ctx->in += 2;
+        length = token & 0x0F;
+        if (!offset) {
+            if (!unpack_base_match(ctx, length)) {
+                return false;
+            }
+            continue;
+        }
+        if (offset > ctx->out_pos || !read_sequence_length(ctx, &length)) {
+            return false;
+        }
+        for (length += PFB_LZ4_MIN_MATCH; length; length--) {
+            if (ctx->out_pos >= ctx->out_length
+                || !put_unpacked_byte(
+                        ctx, get_unpacked_byte(ctx, ctx->out_pos - offset))) {
+                return false;
+            }
+        }
+    }
+
+    return ctx->out_pos == ctx->out_length;
+}
+
+/**
+ * Unpacks the compressed image located at @p payload_addr into the application
+ * slot, chunk by chunk. Sectors that already have the same content are not
+ * written, so an unpacking interrupted by a power loss is simply started over.
+ * The first @p hashed_length bytes of the unpacked image are hashed. Delta
+ * images are applied against the base image located at @p base_addr.
+ */
+static bool unpack_image(uint32_t payload_addr,
+                         uint32_t hashed_length,
+                         uint32_t base_addr) {
+    __unused uint64_t unpack_start_us = time_us_64();
+    const pfb_compressed_image_header_t *header =
+            (const pfb_compressed_image_header_t *) payload_addr;
+    const uint8_t *data = (const uint8_t *) payload_addr + sizeof(*header);
+    pfb_unpack_ctx_t ctx = {
+        .in = data,
+        .in_end = data + header->data_length,
+        .out_pos = 0,
+        .out_length = header->image_length,
+        .chunk_start = 0,
+        .chunk_length = get_chunk_length(
+                0, align_to_sector_size(header->image_length)),
+        .hashed_length = hashed_length,
+        .base = (const uint8_t *) base_addr,
+        .base_length = base_addr ? header->base_length : 0
+    };
+
+    if (hashed_length) {
+        _pfb_start_image_hashing();
+    }
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    bool is_unpacked = unpack_lz4_block(&ctx);
+    // fill the rest of the last sector, so the last chunk is written as well
+    while (is_unpacked && ctx.out_pos < get_unpacked_area_length(&ctx)) {
+        put_unpacked_byte(&ctx, 0xFF);
+    }
+    restore_interrupts(saved_interrupts);
+
+    BOOTLOADER_LOG("Unpacked %lu bytes into %lu bytes in %lu ms",
+                   (unsigned long) header->data_length,
+                   (unsigned long) header->image_length,
+                   (unsigned long) ((time_us_64() - unpack_start_us) / 1000));
+
+    return is_unpacked;
+}
+
+#    ifdef PFB_WITH_OVERWRITE_ONLY_UPDATE
+static bool is_download_image_compressed(void) {
+    const pfb_compressed_image_header_t *header =
+            (const pfb_compressed_image_header_t *) PFB_ADDR_AS_U32(
+                    __FLASH_DOWNLOAD_SLOT_START);
+
+    return header->magic == PFB_COMPRESSED_IMAGE_MAGIC
+           || header->magic == PFB_DELTA_IMAGE_MAGIC;
+}
+
+/**
+ * Unpacks the downloaded image over the application. The download slot stays
+ * untouched, so the unpacking can be safely restarted after a power loss.
+ */
+static pfb_install_result_t overwrite_app_image_with_compressed(void) {
+    uint32_t payload_addr = PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START);
+    const pfb_compressed_image_header_t *header =
+            (const pfb_compressed_image_header_t *) payload_addr;
+
+    // delta images can't be applied, as the base image is not kept anywhere
+    if (!is_compressed_image_header_valid(header,
+                                          _pfb_get_download_image_length())
+        || header->magic == PFB_DELTA_IMAGE_MAGIC
+        || !unpack_image(payload_addr, 0, 0)) {
+        BOOTLOADER_LOG("Invalid compressed image, discarding it");
+        discard_downloaded_image();
+        return PFB_INSTALL_RESULT_REJECTED;
+    }
+
+    _pfb_mark_firmware_copied(header->image_length);
+    return PFB_INSTALL_RESULT_INSTALLED;
+}
+#    else // PFB_WITH_OVERWRITE_ONLY_UPDATE
+typedef enum {
+    PFB_UNPACK_STEP_MOVE_COMPRESSED_IMAGE,
+    PFB_UNPACK_STEP_BACKUP_APP_IMAGE
+} pfb_unpack_step_t;
+
+static bool is_unpack_step_done(pfb_unpack_step_t step) {
+    return *(const uint8_t *) get_journal_step_page_addr(step)
+           == PFB_SWAP_JOURNAL_STEP_DONE;
+}
+
+static void mark_unpack_step_done(pfb_unpack_step_t step) {
+    uint8_t journal_page[FLASH_PAGE_SIZE];
+
+    memset(journal_page, 0xFF, sizeof(journal_page));
+    journal_page[0] = PFB_SWAP_JOURNAL_STEP_DONE;
+    _pfb_program_flash_range(get_journal_step_page_addr(step), journal_page,
+                             FLASH_PAGE_SIZE);
+}
+
+static uint32_t get_compressed_file_length(void) {
+    return align_to_sector_size(_pfb_get_download_image_length());
+}
+
+/**
+ * The compressed image is moved to the end of the area available for images in
+ * the download slot, so the current image can be kept at its beginning.
+ */
+static uint32_t get_moved_compressed_image_addr(void) {
+    return PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START)
+           + PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH)
+           - get_compressed_file_length();
+}
+
+static const pfb_compressed_image_header_t *get_compressed_image_header(void) {
+    // the journal pages are left over by the previous swap or unpacking, so the
+    // step is meaningful only if the journal belongs to this image
+    bool is_moved = is_journal_valid(PFB_UNPACK_JOURNAL_MAGIC,
+                                     get_compressed_file_length())
+                    && is_unpack_step_done(
+                            PFB_UNPACK_STEP_MOVE_COMPRESSED_IMAGE);
+    uint32_t payload_addr =
+            is_moved ? get_moved_compressed_image_addr()
+                     : PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START);
+
+    return (const pfb_compressed_image_header_t *) payload_addr;
+}
+
+static bool is_download_image_compressed(void) {
+    const pfb_compressed_image_header_t *header =
+            (const pfb_compressed_image_header_t *) PFB_ADDR_AS_U32(
+                    __FLASH_DOWNLOAD_SLOT_START);
+
+    // the beginning of the download slot is overwritten after the compressed
+    // image has been moved, so the journal has to be checked as well
+    return is_journal_valid(PFB_UNPACK_JOURNAL_MAGIC,
+                            get_compressed_file_length())
+           || header->magic == PFB_COMPRESSED_IMAGE_MAGIC
+           || header->magic == PFB_DELTA_IMAGE_MAGIC;
+}
+
+/**
+ * Checks if the delta image has been created against the current application
+ * image, which is verified using SHA256 if hashing is enabled.
+ */
+static bool
+is_delta_base_valid(const pfb_compressed_image_header_t *header,
+                    uint32_t backup_length) {
+    if (header->magic != PFB_DELTA_IMAGE_MAGIC) {
+        return true;
+    }
+    if (header->base_length > backup_length) {
+        return false;
+    }
+
+    _pfb_start_image_hashing();
+    _pfb_update_image_hash((const uint8_t *) PFB_ADDR_AS_U32(__FLASH_APP_START),
+                           header->base_length);
+    return _pfb_is_image_hash_valid(header->base_sha256);
+}
+
+static void copy_flash_area(uint32_t dst_addr, uint32_t src_addr, uint32_t len) {
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    for (uint32_t offset = 0; offset < len; offset += PFB_SWAP_CHUNK_SIZE) {
+        copy_flash_range(dst_addr + offset, src_addr + offset,
+                         MIN(PFB_SWAP_CHUNK_SIZE, len - offset));
+    }
+    restore_interrupts(saved_interrupts);
+}
+
+/**
+ * Installs the compressed image, keeping the current one for the rollback:
+ * 1. the compressed image is moved to the end of the download slot,
+ * 2. the current image is copied to the beginning of the download slot, which
+ *    is also the base image for delta images,
+ * 3. the compressed image is unpacked into the application slot.
+ * Steps 1 and 2 don't modify their sources, so they are repeated after a power
+ * loss until recorded in the swap journal. Step 3 is started over.
+ *
+ * Both compressed images and the current image have to fit in the download
+ * slot at the same time, otherwise the compressed image is discarded. The
+ * application checks the same before the download, see
+ * @ref _pfb_is_compressed_file_length_valid.
+ */
+static pfb_install_result_t install_compressed_image(void) {
+    uint32_t file_length = get_compressed_file_length();
+    uint32_t moved_image_addr = get_moved_compressed_image_addr();
+
+    if (is_journal_valid(PFB_UNPACK_JOURNAL_MAGIC, file_length)) {
+        BOOTLOADER_LOG("Resuming the interrupted unpacking");
+    } else {
+        const pfb_compressed_image_header_t *header =
+                get_compressed_image_header();
+        uint32_t backup_length = _pfb_get_app_image_backup_length();
+
+        if (!is_compressed_image_header_valid(
+                    header, _pfb_get_download_image_length())
+            || !_pfb_is_compressed_file_length_valid(file_length)
+            || !is_delta_base_valid(header, backup_length)) {
+            BOOTLOADER_LOG("Compressed image is invalid, too big or doesn't "
+                           "match the current image, discarding it");
+            discard_downloaded_image();
+            return PFB_INSTALL_RESULT_REJECTED;
+        }
+        start_journal(PFB_UNPACK_JOURNAL_MAGIC, file_length, backup_length);
+    }
+
+    uint32_t backup_length = get_journal_header()->backup_length;
+    if (!is_unpack_step_done(PFB_UNPACK_STEP_MOVE_COMPRESSED_IMAGE)) {
+        copy_flash_area(moved_image_addr,
+                        PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START),
+                        file_length);
+        mark_unpack_step_done(PFB_UNPACK_STEP_MOVE_COMPRESSED_IMAGE);
+    }
+    if (!is_unpack_step_done(PFB_UNPACK_STEP_BACKUP_APP_IMAGE)) {
+        copy_flash_area(PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START),
+                        PFB_ADDR_AS_U32(__FLASH_APP_START), backup_length);
+        mark_unpack_step_done(PFB_UNPACK_STEP_BACKUP_APP_IMAGE);
+    }
+
+    uint32_t image_length = get_compressed_image_header()->image_length;
+    bool is_valid =
+            unpack_image(moved_image_addr, get_hashed_length(image_length),
+                         PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START))
+            && is_swapped_image_valid(image_length);
+    _pfb_mark_firmware_unpacked(image_length, backup_length, !is_valid);
+
+    return is_valid ? PFB_INSTALL_RESULT_INSTALLED
+                    : PFB_INSTALL_RESULT_REVERT_REQUIRED;
+}
+#    endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+#endif // PFB_WITH_IMAGE_COMPRESSION
+
+#ifdef PFB_WITH_OVERWRITE_ONLY_UPDATE
+static pfb_install_result_t install_downloaded_image(void) {
+#    ifdef PFB_WITH_IMAGE_COMPRESSION
+    if (is_download_image_compressed()) {
+        BOOTLOADER_LOG("Unpacking the downloaded image over the application");
+        return overwrite_app_image_with_compressed();
+    }
+#    endif // PFB_WITH_IMAGE_COMPRESSION
+
+    BOOTLOADER_LOG("Overwriting the application with the downloaded image");
+    _pfb_set_swap_skipped_sectors(overwrite_app_image(get_copy_length()));
+    _pfb_mark_firmware_copied(_pfb_get_download_image_length());
+    return PFB_INSTALL_RESULT_INSTALLED;
+}
+#else  // PFB_WITH_OVERWRITE_ONLY_UPDATE
+static pfb_install_result_t install_downloaded_image(void) {
+#    ifdef PFB_WITH_IMAGE_COMPRESSION
+    if (is_download_image_compressed()) {
+        BOOTLOADER_LOG("Unpacking the compressed image");
+        return install_compressed_image();
+    }
+#    endif // PFB_WITH_IMAGE_COMPRESSION
+
+    BOOTLOADER_LOG("Swapping images");
+    uint32_t image_length = _pfb_get_download_image_length();
+    _pfb_set_swap_skipped_sectors(
+            swap_images(get_swap_length(), get_hashed_length(image_length)));
+    bool is_valid = is_swapped_image_valid(image_length);
+    _pfb_mark_firmware_swapped(!is_valid);
+
+    return is_valid ? PFB_INSTALL_RESULT_INSTALLED
+                    : PFB_INSTALL_RESULT_REVERT_REQUIRED;
+}
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+#endif // PFB_WITH_DIRECT_XIP
+
+/**
+ * The uncommitted firmware is rolled back only after it has been booted
+ * PFB_TRIAL_BOOTS_COUNT times, so a transient failure (e.g. a brownout) during
+ * its first boot does not cost a swap back and a re-download. The boots
+ * requested using @ref PFB_BOOT_COMMAND_TRIAL_BOOT are not counted. The
+ * interrupted rollback is always resumed, as the application slot holds a
+ * partially swapped image.
+ */
+static bool is_rollback_required(void) {
+#if !defined(PFB_WITH_DIRECT_XIP) && !defined(PFB_WITH_OVERWRITE_ONLY_UPDATE)
+    if (is_rollback_interrupted()) {
+        return true;
+    }
+#endif
+    return _pfb_should_rollback()
+           && !(g_boot_commands & PFB_BOOT_COMMAND_TRIAL_BOOT)
+           && _pfb_get_trial_boots_count() >= PFB_TRIAL_BOOTS_COUNT;
+}
+
+/**
+ * Switches clk_sys between the update profile (@ref PFB_UPDATE_SYS_CLOCK_KHZ)
+ * and the default frequency. The flash SCK is derived from clk_sys using the
+ * divider set up by boot2, which is restored after every flash erase and
+ * program anyway, so the profile speeds up reading the flash as well.
+ * PFB_UPDATE_SYS_CLOCK_KHZ MUST NOT exceed the flash's maximum clock
+ * multiplied by that divider.
+ */
+static void set_update_sys_clock(bool is_enabled) {
+#ifdef PFB_UPDATE_SYS_CLOCK_KHZ
+    uint32_t sys_clock_khz =
+            is_enabled ? PFB_UPDATE_SYS_CLOCK_KHZ : SYS_CLK_KHZ;
+
+    if (!set_sys_clock_khz(sys_clock_khz, false)) {
+        BOOTLOADER_LOG("Can't set clk_sys to %lu kHz",
+                       (unsigned long) sys_clock_khz);
+        return;
+    }
+#    ifdef LIB_PICO_STDIO_UART
+    // clk_peri follows clk_sys, so the baud rate has to be set again
+    uart_set_baudrate(uart_default, PICO_DEFAULT_UART_BAUD_RATE);
+#    endif // LIB_PICO_STDIO_UART
+    BOOTLOADER_LOG("clk_sys set to %lu kHz", (unsigned long) sys_clock_khz);
+#endif // PFB_UPDATE_SYS_CLOCK_KHZ
+    (void) is_enabled;
 }
 
 static void disable_interrupts(void) {
@@ -112,8 +1143,9 @@ static void jump_to_vtor(uint32_t vtor) {
     asm volatile("bx %0" ::"r"(reset_vector));
 }
 
+#if defined(PFB_WITH_BOOTLOADER_LOGS) \
+        && !defined(PFB_REDIRECT_BOOTLOADER_LOGS_TO_RAM)
 static void print_welcome_message(void) {
-#ifdef PFB_WITH_BOOTLOADER_LOGS
     puts("");
     puts("***********************************************************");
     puts("*                                                         *");
@@ -122,39 +1154,163 @@ static void print_welcome_message(void) {
     puts("*                                                         *");
     puts("***********************************************************");
     puts("");
-#endif // PFB_WITH_BOOTLOADER_LOGS
 }
 
-int main(void) {
+static void initialize_logs(void) {
+    uint64_t stdio_init_start_us = time_us_64();
+
     stdio_init_all();
+    // gives the host some time to open the USB serial port
     sleep_ms(2000);
+    g_is_logging_enabled = true;
+    g_boot_stats->stdio_init_time_us =
+            get_elapsed_time_us(stdio_init_start_us);
 
     print_welcome_message();
+}
+#else
+static void initialize_logs(void) {
+    // logs are either disabled or kept in RAM, so there is no I/O to set up
+}
+#endif
+
+static bool should_initialize_logs(bool is_update_pending) {
+    if (g_boot_commands & PFB_BOOT_COMMAND_SKIP_LOGS) {
+        return false;
+    }
+#ifdef PFB_WITH_FAST_BOOT
+    return is_update_pending;
+#else  // PFB_WITH_FAST_BOOT
+    (void) is_update_pending;
+    return true;
+#endif // PFB_WITH_FAST_BOOT
+}
+
+int main(void) {
+    uint64_t boot_start_us = time_us_64();
+    g_boot_stats = _pfb_initialize_shared_ram();
+
+    uint64_t decision_start_us = time_us_64();
+    g_boot_commands = _pfb_consume_boot_commands();
+    _pfb_initialize_info_partition();
+    bool is_update_pending =
+            is_rollback_required() || _pfb_has_firmware_to_swap();
+    g_boot_stats->decision_time_us = get_elapsed_time_us(decision_start_us);
+
+    if (should_initialize_logs(is_update_pending)) {
+        initialize_logs();
+    }
+
+    pfb_update_history_entry_t history_entry = { 0 };
+    if (is_update_pending) {
+        set_update_sys_clock(true);
+        start_update_history_entry(&history_entry);
+    }
 
-    if (_pfb_should_rollback()) {
+    uint64_t update_start_us = time_us_64();
+
+#if defined(PFB_WITH_DIRECT_XIP)
+    if (is_rollback_required()) {
         BOOTLOADER_LOG("Rolling back to the previous firmware");
-        swap_images();
+        _pfb_mark_firmware_rolled_back();
+        history_entry.result = PFB_UPDATE_ROLLED_BACK;
+    } else if (_pfb_should_rollback()) {
+        boot_uncommitted_firmware();
+    } else if (_pfb_has_firmware_to_swap() && is_download_image_downgrade()) {
+        BOOTLOADER_LOG("Lower security counter of new image, discarding it");
+        discard_downloaded_image();
+        history_entry.result = PFB_UPDATE_REJECTED;
+    } else if (_pfb_has_firmware_to_swap() && !is_download_image_valid()) {
+        BOOTLOADER_LOG("Invalid new image, discarding it");
+        discard_downloaded_image();
+        history_entry.result = PFB_UPDATE_REJECTED;
+    } else if (_pfb_has_firmware_to_swap()) {
+        // the images are executed in place, so only the slots are switched
+        BOOTLOADER_LOG("Switching to the downloaded image");
+        _pfb_mark_firmware_swapped(false);
+        history_entry.result = PFB_UPDATE_INSTALLED;
+    } else {
+        BOOTLOADER_LOG("Nothing to swap");
+        _pfb_begin_info_transaction();
         pfb_firmware_commit();
         _pfb_mark_pico_has_no_new_firmware();
-        _pfb_mark_is_after_rollback();
+        pfb_mark_download_slot_as_invalid();
+        _pfb_commit_info_transaction();
+    }
+#elif defined(PFB_WITH_OVERWRITE_ONLY_UPDATE)
+    if (_pfb_has_firmware_to_swap() && is_download_image_downgrade()) {
+        BOOTLOADER_LOG("Lower security counter of new image, discarding it");
+        discard_downloaded_image();
+        history_entry.result = PFB_UPDATE_REJECTED;
+    } else if (_pfb_has_firmware_to_swap() && !is_download_image_valid()) {
+        // there is no previous image to revert to, so the downloaded one is
+        // verified before it overwrites the application
+        BOOTLOADER_LOG("Invalid SHA256 of the downloaded image, discarding it");
+        discard_downloaded_image();
+        history_entry.result = PFB_UPDATE_REJECTED;
+    } else if (_pfb_has_firmware_to_swap()) {
+        history_entry.result =
+                install_downloaded_image() == PFB_INSTALL_RESULT_INSTALLED
+                        ? PFB_UPDATE_INSTALLED
+                        : PFB_UPDATE_REJECTED;
+    } else {
+        BOOTLOADER_LOG("Nothing to swap");
+        discard_downloaded_image();
+    }
+#else
+    if (is_rollback_required()) {
+        BOOTLOADER_LOG("Rolling back to the previous firmware");
+        _pfb_set_swap_skipped_sectors(swap_images(get_swap_length(), 0));
+        _pfb_mark_firmware_rolled_back();
+        history_entry.result = PFB_UPDATE_ROLLED_BACK;
+    } else if (_pfb_should_rollback()) {
+        boot_uncommitted_firmware();
+    } else if (_pfb_has_firmware_to_swap() && is_download_image_downgrade()) {
+        BOOTLOADER_LOG("Lower security counter of new image, discarding it");
+        discard_downloaded_image();
+        history_entry.result = PFB_UPDATE_REJECTED;
     } else if (_pfb_has_firmware_to_swap()) {
-        BOOTLOADER_LOG("Swapping images");
-        swap_images();
-        _pfb_mark_pico_has_new_firmware();
-        _pfb_mark_is_not_after_rollback();
-        _pfb_mark_should_rollback();
+        pfb_install_result_t install_result = install_downloaded_image();
+
+        if (install_result == PFB_INSTALL_RESULT_REVERT_REQUIRED) {
+            // marked as swapped with no trial boots left by the same write,
+            // so the revert interrupted by a power loss is resumed as an
+            // ordinary rollback instead of booting the invalid image
+            BOOTLOADER_LOG("Invalid new image, reverting");
+            _pfb_set_swap_skipped_sectors(swap_images(get_swap_length(), 0));
+            _pfb_mark_firmware_rolled_back();
+            history_entry.result = PFB_UPDATE_REJECTED;
+        } else {
+            history_entry.result =
+                    install_result == PFB_INSTALL_RESULT_INSTALLED
+                            ? PFB_UPDATE_INSTALLED
+                            : PFB_UPDATE_REJECTED;
+        }
     } else {
         BOOTLOADER_LOG("Nothing to swap");
+        _pfb_begin_info_transaction();
         pfb_firmware_commit();
         _pfb_mark_pico_has_no_new_firmware();
+        pfb_mark_download_slot_as_invalid();
+        _pfb_commit_info_transaction();
     }
+#endif
+
+    if (is_update_pending) {
+        g_boot_stats->update_time_us = get_elapsed_time_us(update_start_us);
+        set_update_sys_clock(false);
+
+        history_entry.update_time_us = g_boot_stats->update_time_us;
+        _pfb_add_update_history_entry(&history_entry);
+    }
+    _pfb_store_wear_stats();
 
-    pfb_mark_download_slot_as_invalid();
     BOOTLOADER_LOG("End of execution, executing the application...\n");
+    g_boot_stats->boot_time_us = get_elapsed_time_us(boot_start_us);
 
     disable_interrupts();
     reset_peripherals();
-    jump_to_vtor(__flash_info_app_vtor);
+    jump_to_vtor(_pfb_get_app_slot_addr());
 
     return 0;
 }
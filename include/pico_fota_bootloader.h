@@ -31,12 +31,107 @@ extern "C" {
 
 #define PFB_ALIGN_SIZE (256)
 
+/**
+ * Packs the semantic version of an image, so the versions can be compared
+ * using the integer comparison.
+ */
+#define PFB_IMAGE_VERSION(major, minor, patch)                  \
+    ((((uint32_t) (major) & 0xFF) << 24)                        \
+     | (((uint32_t) (minor) & 0xFF) << 16) | ((uint32_t) (patch) & 0xFFFF))
+
+#define PFB_IMAGE_FLAG_ENCRYPTED (1 << 0)
+#define PFB_IMAGE_FLAG_COMPRESSED (1 << 1)
+
+/**
+ * The highest value of the anti-rollback security counter, see
+ * @ref pfb_get_security_counter.
+ */
+#define PFB_SECURITY_COUNTER_MAX 256
+
+/**
+ * Description of the image kept in one of the slots, stored in the flash info
+ * partition, so it can be queried without scanning the slot. The descriptors
+ * are swapped by the bootloader together with the images.
+ */
+typedef struct {
+    /** Length of the image in bytes, as passed when it has been downloaded. */
+    uint32_t length;
+    /** Version created using @ref PFB_IMAGE_VERSION, 0 if unknown. */
+    uint32_t version;
+    /** Application defined build identifier, 0 if unknown. */
+    uint32_t build_id;
+    /** PFB_IMAGE_FLAG_* flags of the downloaded FOTA image. */
+    uint32_t flags;
+    /**
+     * Anti-rollback security counter of the image, i.e. the lowest value of
+     * the device's counter the image can still be installed with. Raised only
+     * by the releases that fix vulnerabilities, 0 if unknown.
+     */
+    uint32_t security_counter;
+    /** SHA256 of the downloaded FOTA image, zeroed if unknown. */
+    uint8_t sha256[32];
+} pfb_image_descriptor_t;
+
 /**
  * Marks the download slot as valid, i.e. download slot contains proper binary
  * content and the partitions can be swapped. MUST be called before the next
  * reboot, otherwise data from the download slot will be lost.
+ * The image length is stored in the flash info partition, so the bootloader
+ * swaps only the sectors occupied by the new or the current application image
+ * instead of the whole slot.
+ *
+ * @param image_size_bytes Size of the downloaded firmware image in bytes, i.e.
+ *                         the number of bytes written into the download slot.
+ *                         MUST be a multiple of 256.
+ *
+ * @return 1 when @p image_size_bytes is 0, is not a multiple of 256 or exceeds
+ *         the maximum image size (880k), or if @ref PFB_WITH_IMAGE_COMPRESSION
+ *         is defined (in the swap mode), when the compressed image doesn't fit
+ *         in the download slot next to the backup of the current one, see
+ *         @ref pfb_initialize_download_slot_with_descriptor,
+ *         0 otherwise.
+ */
+int pfb_mark_download_slot_as_valid(size_t image_size_bytes);
+
+/**
+ * Works like @ref pfb_mark_download_slot_as_valid, but stores the whole
+ * descriptor of the downloaded image, using a single write of the flash info
+ * partition. @ref pfb_mark_download_slot_as_valid stores only the length, the
+ * flags of the enabled features and, if @ref PFB_WITH_SHA256_HASHING is
+ * defined, the SHA256 appended to the image.
+ *
+ * NOTE: @ref pfb_mark_download_slot_as_valid stores the security counter 0, so
+ *       its images are rejected once the device's counter has been raised.
+ *
+ * @param descriptor Descriptor of the image written into the download slot.
+ *                   Its length MUST meet the requirements of
+ *                   @ref pfb_mark_download_slot_as_valid.
+ *
+ * @return 1 when the length of the image is not valid (including the room
+ *         needed by a compressed image) or its security counter is lower than
+ *         the device's one,
+ *         0 otherwise.
+ */
+int pfb_mark_download_slot_as_valid_with_descriptor(
+        const pfb_image_descriptor_t *descriptor);
+
+/**
+ * Copies the descriptor of the executed application's image. Allows e.g.
+ * skipping the download if the offered version is already installed.
+ *
+ * @param out_descriptor Pointer to the structure the descriptor is copied into.
+ */
+void pfb_get_app_image_descriptor(pfb_image_descriptor_t *out_descriptor);
+
+/**
+ * Copies the descriptor of the image kept in the download slot, i.e. of the
+ * downloaded image before the update or of the previous firmware after it.
+ * NOTE: the descriptor is not cleared by @ref pfb_initialize_download_slot, so
+ *       it is valid only if the download slot has not been written since.
+ *
+ * @param out_descriptor Pointer to the structure the descriptor is copied into.
  */
-void pfb_mark_download_slot_as_valid(void);
+void pfb_get_download_image_descriptor(pfb_image_descriptor_t *out_descriptor);
 
 /**
  * Marks the download slot as invalid, i.e. download slot no longer contains
@@ -67,7 +162,8 @@ bool pfb_is_after_firmware_update(void);
  *                     be a multiple of 256.
  *
  * @return 1 when @p len_bytes or @p offset_bytes are not multiple of 256 or
- *         when ( @p offset_bytes + @p len_bytes ) exceeds download slot size,
+ *         when ( @p offset_bytes + @p len_bytes ) exceeds the maximum image
+ *         size (880k),
  *         negative mbedtls error code in case of an error if
  *         @ref PFB_WITH_IMAGE_ENCRYPTION is defined,
  *         0 otherwise.
@@ -88,29 +184,313 @@ int pfb_write_to_flash_aligned_256_bytes(uint8_t *src,
  */
 int pfb_initialize_download_slot(void);
 
+/**
+ * Works like @ref pfb_initialize_download_slot, but refuses the image described
+ * by @p descriptor (e.g. taken from the header of the FOTA server's manifest)
+ * before erasing the download slot, so an image that would be rejected anyway
+ * is not downloaded at all.
+ *
+ * If @ref PFB_WITH_IMAGE_COMPRESSION is defined (in the swap mode), an image
+ * with the PFB_IMAGE_FLAG_COMPRESSED flag is unpacked next to the backup of the
+ * current image, so its length plus the bigger of its length and the current
+ * image's one MUST NOT exceed 880k (both rounded up to 4k).
+ *
+ * @param descriptor Descriptor of the image about to be downloaded. Its length
+ *                   MUST meet the requirements of
+ *                   @ref pfb_mark_download_slot_as_valid.
+ *
+ * @return 1 when the length of the image is not valid (including the room
+ *         needed by a compressed image) or its security counter is lower than
+ *         the device's one (see @ref pfb_get_security_counter)
+ *         or than the application image's one, which the counter is raised to
+ *         by @ref pfb_firmware_commit called before the erase,
+ *         mbedtls error code in case of a mbedtls error if
+ *         @ref PFB_WITH_IMAGE_ENCRYPTION is defined,
+ *         0 otherwise.
+ */
+int pfb_initialize_download_slot_with_descriptor(
+        const pfb_image_descriptor_t *descriptor);
+
 /**
  * Performs the firmware update. Reboots the Pico and checks if the partitions
  * should be swapped.
  */
 void pfb_perform_update(void);
 
+/**
+ * Skips the initialization of the bootloader's stdio logs, including waiting
+ * for the USB, during the next boot. The logs kept in RAM are still collected.
+ */
+#define PFB_BOOT_COMMAND_SKIP_LOGS (1 << 0)
+/**
+ * Boots the uncommitted firmware again without counting the boot, i.e. neither
+ * a trial boot is used nor the rollback is performed, e.g. for a reboot
+ * intended by the new firmware before it is able to commit itself.
+ */
+#define PFB_BOOT_COMMAND_TRIAL_BOOT (1 << 1)
+
+/**
+ * Reboots the Pico passing the PFB_BOOT_COMMAND_* commands to the bootloader
+ * through the watchdog scratch registers 0-2, so they take no flash writes. The
+ * commands apply only to the very next boot and are dropped by a power loss,
+ * so they MUST NOT be needed to survive it. The firmware update is performed
+ * as well, if the download slot has been marked as valid.
+ * NOTE: the application MUST NOT use the watchdog scratch registers 0-2.
+ *
+ * @param commands Bitwise OR of the PFB_BOOT_COMMAND_* commands.
+ */
+void pfb_reboot(uint32_t commands);
+
 /**
  * Marks the information that the device SHOULD NOT perform rollback in case of
  * a reboot.
+ * The device's security counter is raised to the one of the application's
+ * image descriptor, if it is higher.
+ * If @ref PFB_WITH_OVERWRITE_ONLY_UPDATE is defined, there is no previous
+ * firmware to roll back to, so only the security counter is raised, which the
+ * bootloader already does right after installing the image.
  */
 void pfb_firmware_commit(void);
 
+/**
+ * Returns the device's anti-rollback security counter. The bootloader and the
+ * library reject the images with a lower security counter, see
+ * @ref pfb_image_descriptor_t. The counter is kept as a thermometer code in the
+ * flash info partition, so raising it takes no erase, and it never goes down.
+ *
+ * @return The security counter, at most @ref PFB_SECURITY_COUNTER_MAX.
+ */
+uint32_t pfb_get_security_counter(void);
+
 /**
  * Returns the information if the device has performed a rollback during the
  * reboot.
  * NOTE: this function will return true only if the rollback has been performed
  *       during the very previous reboot.
+ *       If @ref PFB_WITH_OVERWRITE_ONLY_UPDATE is defined, the function will
+ *       always return false.
  *
  * @return true if the rollback has been performed during the previous reboot,
  *         false otherwise.
  */
 bool pfb_is_after_rollback(void);
 
+/**
+ * Returns the number of reboots the uncommitted firmware is still booted again
+ * before the rollback. The firmware is rolled back after it has been booted
+ * PFB_TRIAL_BOOTS_COUNT times without calling @ref pfb_firmware_commit, so
+ * a transient failure during the first boot does not revert the update.
+ * NOTE: If @ref PFB_WITH_OVERWRITE_ONLY_UPDATE is defined, the function will
+ *       always return 0.
+ *
+ * @return Number of the remaining boot attempts if the firmware has not been
+ *         committed yet,
+ *         0 if the firmware has been committed or the rollback will be
+ *         performed during the next reboot.
+ */
+uint32_t pfb_get_remaining_boot_attempts(void);
+
+/**
+ * Returns the information which image has to be downloaded. If
+ * @ref PFB_WITH_DIRECT_XIP is defined, the application is executed directly
+ * from the slot it has been downloaded into, so it is linked for both slots and
+ * the downloaded image MUST match the slot that is not currently executed.
+ *
+ * @return true if <app_name>_download_slot_fota_image.bin has to be
+ *         downloaded,
+ *         false if <app_name>_fota_image.bin has to be downloaded.
+ *         If @ref PFB_WITH_DIRECT_XIP is not defined, the function will always
+ *         return false.
+ */
+bool pfb_is_download_slot_image_required(void);
+
+/**
+ * Returns the number of flash sectors that have not been erased nor programmed
+ * during the images swap performed in the previous boot, because their content
+ * was the same in both slots.
+ * NOTE: the value is passed from the bootloader through RAM, so it is valid
+ *       only until the next reboot.
+ *
+ * @return Number of skipped sectors if the partitions have been swapped during
+ *         the previous reboot,
+ *         0 otherwise.
+ */
+uint32_t pfb_get_swap_skipped_sectors(void);
+
+/**
+ * Timings of the previous boot measured by the bootloader using the hardware
+ * timer. All of the times are in microseconds.
+ */
+typedef struct {
+    /** From the start of the bootloader until jumping to the application. */
+    uint32_t boot_time_us;
+    /**
+     * Initialization of stdio, including the delay letting the USB connect, 0
+     * if it has been skipped by the fast boot.
+     */
+    uint32_t stdio_init_time_us;
+    /** Reading the flash info partition to decide if an update is pending. */
+    uint32_t decision_time_us;
+    /** Whole update, rollback or revert, 0 if none has been performed. */
+    uint32_t update_time_us;
+    /** Erasing the slots and the swap journal. */
+    uint32_t erase_time_us;
+    /** Programming the slots and the swap journal. */
+    uint32_t program_time_us;
+    /** Reading the slots into the bootloader's RAM buffer. */
+    uint32_t copy_time_us;
+    /** Writing the flash info partition. */
+    uint32_t metadata_time_us;
+    uint32_t erased_sectors;
+    uint32_t programmed_pages;
+    /**
+     * The longest time of erasing a single sector, averaged over the sectors
+     * erased using a single call. Useful to find slow flash parts.
+     */
+    uint32_t max_sector_erase_time_us;
+} pfb_boot_stats_t;
+
+/**
+ * Copies the timings of the previous boot measured by the bootloader.
+ * NOTE: the statistics are passed from the bootloader through RAM, so they are
+ *       valid only until the next reboot.
+ *
+ * @param out_stats Pointer to the structure the statistics are copied into.
+ *
+ * @return 1 if the statistics are not available, e.g. the application has not
+ *         been started by the bootloader,
+ *         0 otherwise.
+ */
+int pfb_get_boot_stats(pfb_boot_stats_t *out_stats);
+
+/**
+ * Copies the bootloader's log records of the previous boot, each of them
+ * followed by a new line character. The records are collected only if the
+ * bootloader has been compiled with @ref PFB_REDIRECT_BOOTLOADER_LOGS_TO_RAM.
+ * NOTE: the log is passed from the bootloader through RAM, so it is valid only
+ *       until the next reboot. The oldest records are dropped if the log
+ *       exceeds 3k.
+ *
+ * @param out_buff  Buffer the null-terminated log is copied into.
+ * @param buff_size Size of @p out_buff in bytes. The records that do not fit
+ *                  are not copied.
+ *
+ * @return Length of the copied log, 0 if the log is not available.
+ */
+size_t pfb_read_bootloader_log(char *out_buff, size_t buff_size);
+
+/**
+ * Outcomes of the updates recorded in the update history.
+ */
+typedef enum {
+    /** The downloaded image has been installed. */
+    PFB_UPDATE_INSTALLED = 1,
+    /** The uncommitted firmware has been rolled back. */
+    PFB_UPDATE_ROLLED_BACK,
+    /** The downloaded image has been invalid, so it has been discarded. */
+    PFB_UPDATE_REJECTED,
+} pfb_update_result_t;
+
+/**
+ * Entry of the update history, written by the bootloader after every update,
+ * rollback and rejected image. The versions and build ids come from the image
+ * descriptors, see @ref pfb_image_descriptor_t.
+ */
+typedef struct {
+    /** Starts from 1 and increments with every entry. */
+    uint32_t sequence;
+    /** One of the @ref pfb_update_result_t values. */
+    uint32_t result;
+    /** Version of the application before the update. */
+    uint32_t from_version;
+    /** Version of the image installed, restored or rejected by the update. */
+    uint32_t to_version;
+    uint32_t from_build_id;
+    uint32_t to_build_id;
+    /** Duration of the update in microseconds. */
+    uint32_t update_time_us;
+} pfb_update_history_entry_t;
+
+typedef struct {
+    uint32_t next_sequence;
+} pfb_update_history_iterator_t;
+
+/**
+ * Initializes the iterator over the update history, kept in flash, so it
+ * survives reboots and updates. The history holds at least the last 128
+ * entries.
+ *
+ * @param iterator       Iterator to initialize.
+ * @param first_sequence Sequence number of the first entry to return, e.g. the
+ *                       one following the last entry uploaded by the
+ *                       application. 0 returns the oldest available entry.
+ */
+void pfb_init_update_history_iterator(pfb_update_history_iterator_t *iterator,
+                                      uint32_t first_sequence);
+
+/**
+ * Copies the next entry of the update history, from the oldest to the newest
+ * one.
+ *
+ * @param iterator  Iterator initialized using
+ *                  @ref pfb_init_update_history_iterator.
+ * @param out_entry Pointer to the structure the entry is copied into.
+ *
+ * @return true if the entry has been copied,
+ *         false if there are no more entries.
+ */
+bool pfb_get_next_update_history_entry(pfb_update_history_iterator_t *iterator,
+                                       pfb_update_history_entry_t *out_entry);
+
+/**
+ * Flash regions reported by @ref pfb_get_wear_stats. The slots are the physical
+ * ones, regardless of which of them the application is executed from.
+ */
+typedef enum {
+    /** Both sectors of the flash info partition. */
+    PFB_FLASH_REGION_INFO,
+    /** The slot at __FLASH_APP_START, including its reserved tail. */
+    PFB_FLASH_REGION_APP_SLOT,
+    /** The slot at __FLASH_DOWNLOAD_SLOT_START, up to the reserved tail. */
+    PFB_FLASH_REGION_DOWNLOAD_SLOT,
+    /**
+     * The reserved tail of the download slot, i.e. the swap journal and
+     * scratch, the update history and the wear statistics themselves. The
+     * alternate flash info sector kept there is counted in
+     * @ref PFB_FLASH_REGION_INFO only.
+     */
+    PFB_FLASH_REGION_RESERVED,
+} pfb_flash_region_t;
+
+/**
+ * Wear of a flash region, based on the erase counters of its sectors.
+ */
+typedef struct {
+    uint32_t sectors_count;
+    /** Sum of the erase counters of all of the sectors of the region. */
+    uint32_t total_erase_count;
+    /** Erase counter of the most worn sector of the region. */
+    uint32_t max_erase_count;
+    /** Erase counter averaged over the sectors, rounded down. */
+    uint32_t average_erase_count;
+} pfb_wear_stats_t;
+
+/**
+ * Reports the wear of the flash @p region. The bootloader and the library count
+ * the erases of every sector following the bootloader and keep the counters in
+ * flash, so they survive reboots and updates. The counters saturate at 65535.
+ * NOTE: the counters are stored once per boot by the bootloader and after every
+ *       erasing call by the application, so the erases performed right before
+ *       a power loss may be missed.
+ *
+ * @param region    One of the @ref pfb_flash_region_t values.
+ * @param out_stats Pointer to the structure the statistics are copied into.
+ *
+ * @return 1 if the @p region is invalid,
+ *         0 otherwise.
+ */
+int pfb_get_wear_stats(pfb_flash_region_t region, pfb_wear_stats_t *out_stats);
+
 /**
  * If @ref WITH_SHA256 is defined, checks if the calculated SHA256 of the image
  * matches the expected one. Otherwise, the function will only return 0.
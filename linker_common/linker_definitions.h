@@ -42,9 +42,30 @@ extern uint32_t __FLASH_INFO_IS_DOWNLOAD_SLOT_VALID;
 extern uint32_t __FLASH_INFO_IS_FIRMWARE_SWAPPED;
 extern uint32_t __FLASH_INFO_IS_AFTER_ROLLBACK;
 extern uint32_t __FLASH_INFO_SHOULD_ROLLBACK;
+extern uint32_t __FLASH_INFO_APP_IMAGE_LENGTH;
+extern uint32_t __FLASH_INFO_DOWNLOAD_IMAGE_LENGTH;
+extern uint32_t __FLASH_INFO_SWAP_COUNTER;
+extern uint32_t __FLASH_INFO_APP_DESCRIPTOR;
+extern uint32_t __FLASH_INFO_DOWNLOAD_DESCRIPTOR;
+extern uint32_t __FLASH_INFO_SEQUENCE;
+extern uint32_t __FLASH_INFO_CHECKSUM;
+extern uint32_t __FLASH_INFO_CLEARED_FLAGS;
+extern uint32_t __FLASH_INFO_TRIAL_BOOTS;
+extern uint32_t __FLASH_INFO_SECURITY_COUNTER;
+extern uint32_t __FLASH_INFO_SECURITY_COUNTER_LENGTH;
 extern uint32_t __FLASH_APP_START;
 extern uint32_t __FLASH_DOWNLOAD_SLOT_START;
 extern uint32_t __FLASH_SWAP_SPACE_LENGTH;
+extern uint32_t __FLASH_IMAGE_MAX_LENGTH;
+extern uint32_t __FLASH_RESERVED_START;
+extern uint32_t __FLASH_SWAP_JOURNAL_START;
+extern uint32_t __FLASH_INFO_ALTERNATE_START;
+extern uint32_t __FLASH_UPDATE_HISTORY_START;
+extern uint32_t __FLASH_UPDATE_HISTORY_LENGTH;
+extern uint32_t __FLASH_WEAR_STATS_START;
+extern uint32_t __FLASH_WEAR_STATS_LENGTH;
+extern uint32_t __FLASH_SWAP_SCRATCH_START;
+extern uint32_t __SHARED_RAM_START;
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+# Copyright (c) 2024 Jakub Zimnol
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+from argparse import ArgumentParser
+import os
+import struct
+
+# must match PFB_COMPRESSED_IMAGE_MAGIC in bootloader.c ("PFBZ")
+COMPRESSED_IMAGE_MAGIC = 0x5a424650
+# must match pfb_compressed_image_header_t in bootloader.c
+HEADER_FORMAT = '<IIII32s'
+
+# LZ4 block format constants
+MIN_MATCH = 4
+MAX_OFFSET = 0xFFFF
+MATCH_FIND_LIMIT = 12
+LAST_LITERALS = 5
+
+
+def _write_length(output, length):
+    length -= 15
+    while length >= 255:
+        output.append(255)
+        length -= 255
+    output.append(length)
+
+
+def write_sequence(output, literals, offset=None, match_length=0, base_position=None):
+    """
+    Writes a single LZ4 sequence. If base_position is given, the match refers to
+    the base image instead of the already decoded data, which is encoded as a
+    zero offset followed by the 24-bit position in the base image.
+    """
+    literals_length = len(literals)
+    token = min(literals_length, 15) << 4
+    if offset is not None:
+        token |= min(match_length - MIN_MATCH, 15)
+    output.append(token)
+    if literals_length >= 15:
+        _write_length(output, literals_length)
+    output += literals
+    if offset is not None:
+        output += struct.pack('<H', offset)
+        if offset == 0:
+            output += struct.pack('<I', base_position)[:3]
+        if match_length - MIN_MATCH >= 15:
+            _write_length(output, match_length - MIN_MATCH)
+
+
+def find_match_length(data, position, reference, reference_position, limit):
+    match_length = 0
+    while (position + match_length < limit
+           and reference_position + match_length < len(reference)
+           and reference[reference_position + match_length] == data[position + match_length]):
+        match_length += 1
+    return match_length
+
+
+def make_header(magic, image_length, data_length, base_length=0, base_sha256=bytes(32)):
+    return struct.pack(HEADER_FORMAT, magic, image_length, data_length, base_length, base_sha256)
+
+
+def pad_to_256_bytes(data):
+    return data + b'\x00' * (-len(data) % 256)
+
+
+def compress(data):
+    """Compresses data using the LZ4 block format (greedy matching)."""
+    output = bytearray()
+    last_positions = {}
+    anchor = 0
+    position = 0
+    match_find_end = len(data) - MATCH_FIND_LIMIT
+    match_end_limit = len(data) - LAST_LITERALS
+
+    while position < match_find_end:
+        key = data[position:position + MIN_MATCH]
+        candidate = last_positions.get(key)
+        last_positions[key] = position
+        if candidate is None or position - candidate > MAX_OFFSET:
+            position += 1
+            continue
+
+        match_length = find_match_length(data, position, data, candidate, match_end_limit)
+        if match_length < MIN_MATCH:
+            position += 1
+            continue
+
+        write_sequence(output, data[anchor:position], position - candidate, match_length)
+        position += match_length
+        anchor = position
+
+    write_sequence(output, data[anchor:])
+    return output
+
+
+def _main():
+    parser = ArgumentParser(
+        description='Compress the firmware file that will be sent to the device using the LZ4 block format.')
+    parser.add_argument('-t', '--target-file', help='Path to the firmware file', required=True)
+
+    args = parser.parse_args()
+
+    binary_file_path = args.target_file
+
+    if not os.path.exists(binary_file_path):
+        raise FileNotFoundError(f"LZ4: file {binary_file_path} does not exist")
+    if not binary_file_path.endswith('.bin'):
+        raise ValueError(f"LZ4: file {binary_file_path} is not a binary file")
+
+    print(f"LZ4: using binary: {binary_file_path}")
+
+    with open(binary_file_path, 'rb') as file:
+        binary_file_data = file.read()
+
+    if len(binary_file_data) % 256:
+        raise ValueError("LZ4: binary file size must be a multiple of 256")
+
+    compressed_data = compress(binary_file_data)
+    output = pad_to_256_bytes(make_header(COMPRESSED_IMAGE_MAGIC, len(binary_file_data),
+                                          len(compressed_data)) + compressed_data)
+
+    with open(binary_file_path, 'wb') as file:
+        file.write(output)
+
+    print(f"LZ4: compressed {len(binary_file_data)} bytes into {len(output)} bytes")
+
+
+if __name__ == '__main__':
+    _main()
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+# Copyright (c) 2024 Jakub Zimnol
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+from argparse import ArgumentParser
+from hashlib import sha256
+import os
+
+from compress_image import (MAX_OFFSET, MIN_MATCH, MATCH_FIND_LIMIT, LAST_LITERALS,
+                            find_match_length, make_header, pad_to_256_bytes, write_sequence)
+
+# must match PFB_DELTA_IMAGE_MAGIC in bootloader.c ("PFBD")
+DELTA_IMAGE_MAGIC = 0x44424650
+
+# the bootloader reads 24-bit positions in the base image
+MAX_BASE_LENGTH = 1 << 24
+# a match in the base image is encoded using 3 more bytes than an LZ4 match
+MIN_BASE_MATCH = 8
+BASE_INDEX_STRIDE = 4
+BASE_INDEX_CANDIDATES = 8
+
+
+def _index_base(base):
+    index = {}
+    for position in range(0, len(base) - MIN_BASE_MATCH + 1, BASE_INDEX_STRIDE):
+        candidates = index.setdefault(base[position:position + MIN_BASE_MATCH], [])
+        if len(candidates) < BASE_INDEX_CANDIDATES:
+            candidates.append(position)
+    return index
+
+
+def encode_delta(base, data):
+    """
+    Encodes data as LZ4 sequences whose matches refer either to the already
+    decoded data or to the base image. The base image is indexed sparsely, so
+    the matches are extended backwards over the pending literals.
+    """
+    output = bytearray()
+    base_index = _index_base(base)
+    last_positions = {}
+    last_base_shift = 0
+    anchor = 0
+    position = 0
+    match_find_end = len(data) - MATCH_FIND_LIMIT
+    match_end_limit = len(data) - LAST_LITERALS
+
+    while position < match_find_end:
+        best_length = 0
+        best_start = position
+        best_offset = None
+        best_base_position = None
+
+        key = data[position:position + MIN_MATCH]
+        candidate = last_positions.get(key)
+        last_positions[key] = position
+        if candidate is not None and position - candidate <= MAX_OFFSET:
+            match_length = find_match_length(data, position, data, candidate, match_end_limit)
+            if match_length >= MIN_MATCH:
+                best_length, best_offset = match_length, position - candidate
+
+        # the code after the previous change is usually shifted by the same
+        # number of bytes, so that position is always tried first
+        base_candidates = [position - last_base_shift]
+        base_candidates += base_index.get(data[position:position + MIN_BASE_MATCH], [])
+        for base_position in base_candidates:
+            if base_position < 0 or base_position >= len(base):
+                continue
+            match_length = find_match_length(data, position, base, base_position, match_end_limit)
+            if match_length < MIN_BASE_MATCH:
+                continue
+            start = position
+            while start > anchor and base_position > 0 and data[start - 1] == base[base_position - 1]:
+                start -= 1
+                base_position -= 1
+                match_length += 1
+            if start + match_length > best_start + best_length:
+                best_length, best_start = match_length, start
+                best_offset, best_base_position = 0, base_position
+
+        if best_offset is None:
+            position += 1
+            continue
+
+        write_sequence(output, data[anchor:best_start], best_offset, best_length, best_base_position)
+        if best_base_position is not None:
+            last_base_shift = best_start - best_base_position
+        position = best_start + best_length
+        anchor = position
+
+    write_sequence(output, data[anchor:])
+    return output
+
+
+def _main():
+    parser = ArgumentParser(
+        description='Create the delta of the firmware file against the firmware running on the device.')
+    parser.add_argument('-b', '--base-file', help='Path to the raw firmware file running on the device',
+                        required=True)
+    parser.add_argument('-t', '--target-file', help='Path to the raw new firmware file', required=True)
+    parser.add_argument('-o', '--output-file', help='Path to the output delta file', required=True)
+
+    args = parser.parse_args()
+
+    for file_path in (args.base_file, args.target_file, args.output_file):
+        if not file_path.endswith('.bin'):
+            raise ValueError(f"DELTA: file {file_path} is not a binary file")
+    for file_path in (args.base_file, args.target_file):
+        if not os.path.exists(file_path):
+            raise FileNotFoundError(f"DELTA: file {file_path} does not exist")
+
+    print(f"DELTA: using base binary: {args.base_file}")
+    print(f"DELTA: using binary: {args.target_file}")
+
+    with open(args.base_file, 'rb') as file:
+        base_data = file.read()
+    with open(args.target_file, 'rb') as file:
+        binary_file_data = file.read()
+
+    if len(binary_file_data) % 256:
+        raise ValueError("DELTA: binary file size must be a multiple of 256")
+    if len(base_data) >= MAX_BASE_LENGTH:
+        raise ValueError("DELTA: base binary file is too big")
+
+    delta_data = encode_delta(base_data, binary_file_data)
+    output = pad_to_256_bytes(make_header(DELTA_IMAGE_MAGIC, len(binary_file_data), len(delta_data),
+                                          len(base_data), sha256(base_data).digest()) + delta_data)
+
+    with open(args.output_file, 'wb') as file:
+        file.write(output)
+
+    print(f"DELTA: output path: {args.output_file}")
+    print(f"DELTA: {len(binary_file_data)} bytes encoded into {len(output)} bytes")
+
+
+if __name__ == '__main__':
+    _main()
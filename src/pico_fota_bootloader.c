@@ -21,6 +21,8 @@
  */
 
 #include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -54,74 +56,940 @@
 #define PFB_SHOULD_ROLLBACK_MAGIC 0xdeadead
 #define PFB_SHOULD_NOT_ROLLBACK_MAGIC 0x00000000
 
+#define PFB_SHARED_RAM_MAGIC 0x5fb5a7ed
+
+/**
+ * The commands passed to the bootloader are kept in the watchdog scratch
+ * registers, which survive the watchdog reboot, but not a power loss. The
+ * registers 4-7 are used by the SDK and the bootrom.
+ */
+#define PFB_BOOT_COMMANDS_MAGIC 0xb007c0de
+#define PFB_BOOT_COMMANDS_MAGIC_SCRATCH 0
+#define PFB_BOOT_COMMANDS_SCRATCH 1
+#define PFB_BOOT_COMMANDS_CHECKSUM_SCRATCH 2
+
 #define PFB_SHA256_DIGEST_SIZE 32
 #define PFB_AES_BLOCK_SIZE 16
 
+/**
+ * Number of words of a single flash info record, i.e. the __FLASH_INFO_* words
+ * defined in linker_definitions.ld, including the checksum.
+ */
+#define PFB_INFO_RECORD_WORDS_COUNT 35
+#define PFB_INFO_RECORDS_COUNT (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+/**
+ * Layout of the __FLASH_INFO_APP_DESCRIPTOR and __FLASH_INFO_DOWNLOAD_DESCRIPTOR
+ * words, __FLASH_INFO_DESCRIPTOR_LENGTH bytes long. The image length is kept in
+ * the __FLASH_INFO_*_IMAGE_LENGTH words instead.
+ */
+typedef struct {
+    uint32_t version;
+    uint32_t build_id;
+    uint32_t flags;
+    uint32_t security_counter;
+    uint8_t sha256[PFB_SHA256_DIGEST_SIZE];
+} pfb_info_image_descriptor_t;
+
+#define PFB_INFO_DESCRIPTOR_WORDS_COUNT \
+    (sizeof(pfb_info_image_descriptor_t) / sizeof(uint32_t))
+
+#define PFB_SECURITY_COUNTER_WORDS_COUNT (PFB_SECURITY_COUNTER_MAX / 32)
+
+#define PFB_RAM_LOG_SIZE 3072
+#define PFB_RAM_LOG_MAX_RECORD_LENGTH 128
+
+/**
+ * Header preceding every record of the bootloader's log kept in the shared RAM.
+ * The text of the record follows the header and is not null-terminated.
+ */
+typedef struct {
+    uint16_t length;
+    /** CRC-16/CCITT of the text, detects records corrupted by a power loss. */
+    uint16_t crc;
+} pfb_ram_log_record_header_t;
+
+/**
+ * Entry of the update history as stored in flash. The sum of all of its words
+ * is 0, so an entry torn by a power loss is ignored.
+ */
+typedef struct {
+    pfb_update_history_entry_t entry;
+    uint32_t checksum;
+} pfb_update_history_record_t;
+
+/**
+ * Number of the erase counters of a single wear statistics record, enough for
+ * all of the sectors from __FLASH_INFO_START up to the end of the 2MB flash.
+ */
+#define PFB_WEAR_STATS_COUNTERS_COUNT 508
+
+/**
+ * Erase counters of the flash sectors, starting from the one at
+ * __FLASH_INFO_START, as stored in flash. The sum of all of its words is 0, so
+ * a record torn by a power loss is ignored.
+ */
+typedef struct {
+    uint32_t sequence;
+    uint32_t checksum;
+    uint16_t erase_counts[PFB_WEAR_STATS_COUNTERS_COUNT];
+} pfb_wear_stats_record_t;
+
+/**
+ * Layout of the RAM shared between the bootloader and the application. Filled
+ * by the bootloader during every boot.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t swap_skipped_sectors;
+    pfb_boot_stats_t boot_stats;
+    /**
+     * Positions of the oldest record and of the next record in the log ring
+     * buffer. Both grow monotonically and are wrapped only on access.
+     */
+    uint32_t log_first;
+    uint32_t log_next;
+    uint8_t log[PFB_RAM_LOG_SIZE];
+} pfb_shared_ram_t;
+
+#define PFB_SHARED_RAM \
+    ((volatile pfb_shared_ram_t *) PFB_ADDR_AS_U32(__SHARED_RAM_START))
+
 #ifdef PFB_WITH_IMAGE_ENCRYPTION
 mbedtls_aes_context g_aes_ctx;
 #endif // PFB_WITH_IMAGE_ENCRYPTION
+#ifdef PFB_WITH_SHA256_HASHING
+static mbedtls_sha256_context g_image_sha256_ctx;
+static int g_image_sha256_ret;
+#endif // PFB_WITH_SHA256_HASHING
+
+/**
+ * Set only by the bootloader, so flash operations performed by the application
+ * are not accounted in the boot statistics.
+ */
+static pfb_boot_stats_t *g_boot_stats;
+
+static uint32_t get_elapsed_time_us(uint64_t start_us) {
+    return (uint32_t) (time_us_64() - start_us);
+}
+
+typedef struct {
+    uint32_t dest_addr;
+    uint32_t data;
+} pfb_flash_info_word_t;
+
+/**
+ * Words staged by the transaction opened using
+ * @ref _pfb_begin_info_transaction, so several changes are stored using a
+ * single record of the flash info partition.
+ */
+static struct {
+    bool is_open;
+    size_t words_count;
+    pfb_flash_info_word_t words[PFB_INFO_RECORD_WORDS_COUNT - 1];
+} g_info_transaction;
+
+/**
+ * Erase counters loaded from the newest wear statistics record on first use,
+ * incremented in RAM by every erase and stored by @ref store_wear_stats.
+ */
+static struct {
+    bool is_loaded;
+    bool is_dirty;
+    /**
+     * Set by the bootloader, which stores the erase counters once at the end of
+     * the boot instead of after every write of the flash info partition.
+     */
+    bool is_store_deferred;
+    pfb_wear_stats_record_t record;
+} g_wear_stats;
+
+static bool is_erased(const void *data, size_t len) {
+    const uint32_t *data_u32 = (const uint32_t *) data;
+
+    for (size_t i = 0; i < len / sizeof(uint32_t); i++) {
+        if (data_u32[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns the value the @p words have to be completed with to sum up to 0,
+ * which is how the records of the flash info partition, the update history and
+ * the wear statistics detect being torn by a power loss.
+ */
+static uint32_t calculate_checksum(const uint32_t *words, size_t words_count) {
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < words_count; i++) {
+        sum += words[i];
+    }
+    return 0 - sum;
+}
+
+static bool is_checksum_valid(const uint32_t *words, size_t words_count) {
+    // an erased record sums up to a non-zero value as well
+    return calculate_checksum(words, words_count) == 0;
+}
+
+static bool is_info_record_valid(const uint32_t *record) {
+    return is_checksum_valid(record, PFB_INFO_RECORD_WORDS_COUNT);
+}
+
+static size_t get_info_word_index(uint32_t addr) {
+    return (addr - PFB_ADDR_AS_U32(__FLASH_INFO_START)) / sizeof(uint32_t);
+}
+
+/**
+ * Returns the newest record of the flash info sector with a valid checksum,
+ * i.e. skips the record torn by a power loss during its programming.
+ *
+ * @return Pointer to the record in flash, NULL if there is no valid record.
+ */
+static const uint32_t *get_newest_info_record_in_sector(uint32_t sector_addr) {
+    for (int i = PFB_INFO_RECORDS_COUNT - 1; i >= 0; i--) {
+        const uint32_t *record =
+                (const uint32_t *) (sector_addr + i * FLASH_PAGE_SIZE);
+        if (is_info_record_valid(record)) {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the valid record with the highest sequence number from both of the
+ * flash info sectors.
+ *
+ * @return Pointer to the record in flash, NULL if there is no valid record
+ *         (only if the flash info partition has been erased externally).
+ */
+static const uint32_t *get_info_record(void) {
+    size_t sequence_index =
+            get_info_word_index(PFB_ADDR_AS_U32(__FLASH_INFO_SEQUENCE));
+    const uint32_t *record = get_newest_info_record_in_sector(
+            PFB_ADDR_AS_U32(__FLASH_INFO_START));
+    const uint32_t *alternate_record = get_newest_info_record_in_sector(
+            PFB_ADDR_AS_U32(__FLASH_INFO_ALTERNATE_START));
+
+    if (!record
+        || (alternate_record
+            && alternate_record[sequence_index] > record[sequence_index])) {
+        return alternate_record;
+    }
+    return record;
+}
+
+/**
+ * Returns the bit of the __FLASH_INFO_CLEARED_FLAGS word that, once cleared,
+ * overrides the word at @p addr with its cleared value.
+ *
+ * @param addr                Address of the word in the first record.
+ * @param out_cleared_value   The value the word is overridden with.
+ *
+ * @return Mask of the bit, 0 if the word can't be cleared in place.
+ */
+static uint32_t get_cleared_flag_mask(uint32_t addr,
+                                      uint32_t *out_cleared_value) {
+    if (addr == PFB_ADDR_AS_U32(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID)) {
+        *out_cleared_value = PFB_SHOULD_NOT_SWAP_MAGIC;
+        return 1 << 0;
+    }
+    if (addr == PFB_ADDR_AS_U32(__FLASH_INFO_IS_FIRMWARE_SWAPPED)) {
+        *out_cleared_value = PFB_NO_NEW_FIRMWARE_MAGIC;
+        return 1 << 1;
+    }
+    if (addr == PFB_ADDR_AS_U32(__FLASH_INFO_SHOULD_ROLLBACK)) {
+        *out_cleared_value = PFB_SHOULD_NOT_ROLLBACK_MAGIC;
+        return 1 << 2;
+    }
+    return 0;
+}
+
+/**
+ * Reads the word of the current flash info record.
+ *
+ * @param addr Address of the word in the first record, i.e. one of the
+ *             __FLASH_INFO_* addresses defined in linker_definitions.ld.
+ */
+static uint32_t read_info_word(uint32_t addr) {
+    if (g_info_transaction.is_open) {
+        for (size_t i = 0; i < g_info_transaction.words_count; i++) {
+            if (g_info_transaction.words[i].dest_addr == addr) {
+                return g_info_transaction.words[i].data;
+            }
+        }
+    }
+
+    const uint32_t *record = get_info_record();
+
+    if (record) {
+        uint32_t cleared_value;
+        uint32_t mask = get_cleared_flag_mask(addr, &cleared_value);
+        uint32_t cleared_flags = record[get_info_word_index(
+                PFB_ADDR_AS_U32(__FLASH_INFO_CLEARED_FLAGS))];
+
+        return (!mask || (cleared_flags & mask))
+                       ? record[get_info_word_index(addr)]
+                       : cleared_value;
+    }
+    // same defaults as the record programmed together with the bootloader
+    if (addr == PFB_ADDR_AS_U32(__FLASH_INFO_APP_HEADER)) {
+        return PFB_ADDR_AS_U32(__FLASH_APP_START);
+    }
+    if (addr == PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_HEADER)) {
+        return PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START);
+    }
+    return 0;
+}
+
+/**
+ * Returns the address of the first record following the last used one in the
+ * sector. Records torn by a power loss are considered used, as they can't be
+ * programmed again without an erase.
+ *
+ * @return Address of the free record, 0 if the sector is full.
+ */
+static uint32_t get_free_record_addr(uint32_t sector_addr, size_t record_size) {
+    for (uint32_t addr = sector_addr + FLASH_SECTOR_SIZE; addr > sector_addr;
+         addr -= record_size) {
+        if (!is_erased((const void *) (addr - record_size), record_size)) {
+            return addr < sector_addr + FLASH_SECTOR_SIZE ? addr : 0;
+        }
+    }
+    return sector_addr;
+}
+
+static const pfb_wear_stats_record_t *find_newest_wear_stats_record(void) {
+    uint32_t stats_start_addr = PFB_ADDR_AS_U32(__FLASH_WEAR_STATS_START);
+    uint32_t stats_end_addr =
+            stats_start_addr + PFB_ADDR_AS_U32(__FLASH_WEAR_STATS_LENGTH);
+    const pfb_wear_stats_record_t *newest = NULL;
+
+    for (uint32_t addr = stats_start_addr; addr < stats_end_addr;
+         addr += sizeof(pfb_wear_stats_record_t)) {
+        const pfb_wear_stats_record_t *record =
+                (const pfb_wear_stats_record_t *) addr;
+
+        if (is_checksum_valid((const uint32_t *) record,
+                              sizeof(*record) / sizeof(uint32_t))
+            && (!newest || record->sequence > newest->sequence)) {
+            newest = record;
+        }
+    }
+    return newest;
+}
+
+static void load_wear_stats(void) {
+    if (g_wear_stats.is_loaded) {
+        return;
+    }
+
+    const pfb_wear_stats_record_t *newest = find_newest_wear_stats_record();
+    if (newest) {
+        memcpy(&g_wear_stats.record, newest, sizeof(g_wear_stats.record));
+    } else {
+        memset(&g_wear_stats.record, 0, sizeof(g_wear_stats.record));
+    }
+    g_wear_stats.is_loaded = true;
+}
+
+/**
+ * Increments the erase counters of the sectors in RAM only, so it can be called
+ * right before every erase. The sectors preceding __FLASH_INFO_START, i.e. the
+ * bootloader's ones, are never erased by the library.
+ */
+static void count_sector_erases(uint32_t addr, size_t len) {
+    uint32_t first_sector_addr = PFB_ADDR_AS_U32(__FLASH_INFO_START);
+
+    load_wear_stats();
+    for (uint32_t sector = addr; sector < addr + len;
+         sector += FLASH_SECTOR_SIZE) {
+        size_t index = (sector - first_sector_addr) / FLASH_SECTOR_SIZE;
+        assert(sector >= first_sector_addr
+               && index < PFB_WEAR_STATS_COUNTERS_COUNT);
+
+        if (g_wear_stats.record.erase_counts[index] < UINT16_MAX) {
+            g_wear_stats.record.erase_counts[index]++;
+        }
+    }
+    g_wear_stats.is_dirty = true;
+}
+
+/**
+ * Appends the @p record to the two sectors starting at @p area_start_addr,
+ * which are used alternately, so the records of the sector holding
+ * @p newest_record are kept intact while the other sector is erased.
+ *
+ * @param checksum Word of the @p record completing the sum of all of its words
+ *                 to 0. It's calculated right before programming, as erasing
+ *                 the sector may change the record of the wear statistics.
+ */
+static void append_checksummed_record(uint32_t area_start_addr,
+                                      const void *newest_record,
+                                      void *record,
+                                      size_t record_size,
+                                      uint32_t *checksum) {
+    uint32_t page[FLASH_PAGE_SIZE / sizeof(uint32_t)];
+    uint32_t second_sector_addr = area_start_addr + FLASH_SECTOR_SIZE;
+    uint32_t sector_addr =
+            newest_record && (uint32_t) newest_record >= second_sector_addr
+                    ? second_sector_addr
+                    : area_start_addr;
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    uint32_t record_addr = get_free_record_addr(sector_addr, record_size);
+    if (!record_addr) {
+        // the sector is full, so the records of the other (older) one are
+        // dropped, keeping the newer ones intact
+        record_addr = sector_addr == area_start_addr ? second_sector_addr
+                                                     : area_start_addr;
+        count_sector_erases(record_addr, FLASH_SECTOR_SIZE);
+        flash_range_erase(record_addr - XIP_BASE, FLASH_SECTOR_SIZE);
+    }
+
+    *checksum = 0;
+    *checksum = calculate_checksum((const uint32_t *) record,
+                                   record_size / sizeof(uint32_t));
+    if (record_size % FLASH_PAGE_SIZE) {
+        // programming the bytes of an erased value does not change the flash
+        uint32_t page_addr = record_addr & ~(FLASH_PAGE_SIZE - 1);
+        memset(page, 0xFF, sizeof(page));
+        memcpy((uint8_t *) page + (record_addr - page_addr), record,
+               record_size);
+        flash_range_program(page_addr - XIP_BASE, (const uint8_t *) page,
+                            FLASH_PAGE_SIZE);
+    } else {
+        flash_range_program(record_addr - XIP_BASE, (const uint8_t *) record,
+                            record_size);
+    }
+    restore_interrupts(saved_interrupts);
+}
+
+/**
+ * Appends the erase counters counted since the last call to the wear
+ * statistics.
+ */
+static void store_wear_stats(void) {
+    if (!g_wear_stats.is_dirty) {
+        return;
+    }
 
-static inline void erase_flash_info_partition_isr_unsafe(void) {
-    flash_range_erase(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_INFO_START),
-                      FLASH_SECTOR_SIZE);
+    const pfb_wear_stats_record_t *newest = find_newest_wear_stats_record();
+
+    g_wear_stats.record.sequence = newest ? newest->sequence + 1 : 1;
+    uint64_t start_us = time_us_64();
+
+    append_checksummed_record(PFB_ADDR_AS_U32(__FLASH_WEAR_STATS_START), newest,
+                              &g_wear_stats.record, sizeof(g_wear_stats.record),
+                              &g_wear_stats.record.checksum);
+    g_wear_stats.is_dirty = false;
+
+    if (g_boot_stats) {
+        g_boot_stats->metadata_time_us += get_elapsed_time_us(start_us);
+    }
+}
+
+/**
+ * Programs the word of the @p record that is not covered by the checksum. Only
+ * the bits cleared in @p data change, so it needs neither an erase nor a new
+ * record.
+ */
+static void program_record_word_isr_unsafe(const uint32_t *record,
+                                           size_t index,
+                                           uint32_t data) {
+    uint32_t page[FLASH_PAGE_SIZE / sizeof(uint32_t)];
+
+    // programming the bytes of an erased value does not change the flash
+    memset(page, 0xFF, sizeof(page));
+    page[index] = data;
+    flash_range_program((uint32_t) record - XIP_BASE, (const uint8_t *) page,
+                        FLASH_PAGE_SIZE);
+}
+
+/**
+ * Clears the flags by clearing the bits of the current record's
+ * __FLASH_INFO_CLEARED_FLAGS word.
+ *
+ * @return false if any of the @p words is not a flag being cleared or there is
+ *         no valid record, true otherwise.
+ */
+static bool clear_flags_in_place_isr_unsafe(const pfb_flash_info_word_t *words,
+                                            size_t words_count) {
+    const uint32_t *record = get_info_record();
+    size_t cleared_flags_index =
+            get_info_word_index(PFB_ADDR_AS_U32(__FLASH_INFO_CLEARED_FLAGS));
+
+    if (!record) {
+        return false;
+    }
+
+    uint32_t cleared_flags = record[cleared_flags_index];
+    for (size_t i = 0; i < words_count; i++) {
+        uint32_t cleared_value;
+        uint32_t mask = get_cleared_flag_mask(words[i].dest_addr,
+                                              &cleared_value);
+
+        if (!mask || words[i].data != cleared_value) {
+            return false;
+        }
+        cleared_flags &= ~mask;
+    }
+
+    program_record_word_isr_unsafe(record, cleared_flags_index, cleared_flags);
+    return true;
+}
+
+static uint32_t get_record_security_counter(const uint32_t *record) {
+    size_t first_index =
+            get_info_word_index(PFB_ADDR_AS_U32(__FLASH_INFO_SECURITY_COUNTER));
+    uint32_t counter = 0;
+
+    for (size_t i = 0; i < PFB_SECURITY_COUNTER_WORDS_COUNT; i++) {
+        counter += __builtin_popcount(~record[first_index + i]);
+    }
+    return counter;
+}
+
+/**
+ * The security counter words follow the checksum, so a record torn by a power
+ * loss may hold a lower counter despite its valid checksum. Hence the highest
+ * counter of all of the valid records is used, not the current record's one.
+ */
+static uint32_t get_security_counter(void) {
+    uint32_t sectors[] = { PFB_ADDR_AS_U32(__FLASH_INFO_START),
+                           PFB_ADDR_AS_U32(__FLASH_INFO_ALTERNATE_START) };
+    uint32_t counter = 0;
+
+    for (size_t i = 0; i < count_of(sectors); i++) {
+        for (size_t j = 0; j < PFB_INFO_RECORDS_COUNT; j++) {
+            const uint32_t *record =
+                    (const uint32_t *) (sectors[i] + j * FLASH_PAGE_SIZE);
+
+            if (is_info_record_valid(record)) {
+                counter = MAX(counter, get_record_security_counter(record));
+            }
+        }
+    }
+    return counter;
+}
+
+/**
+ * Encodes the @p counter as the thermometer code, i.e. clears its number of
+ * bits, starting from the least significant bit of the first word.
+ */
+static void get_security_counter_words(uint32_t counter, uint32_t *out_words) {
+    for (size_t i = 0; i < PFB_SECURITY_COUNTER_WORDS_COUNT; i++) {
+        uint32_t cleared_bits = MIN(counter, 32);
+
+        out_words[i] = cleared_bits == 32 ? 0 : 0xFFFFFFFF << cleared_bits;
+        counter -= cleared_bits;
+    }
+}
+
+/**
+ * Raises the security counter by clearing the bits of the current record's
+ * __FLASH_INFO_SECURITY_COUNTER words, so it takes neither an erase nor a new
+ * record. A power loss during the write leaves the counter between the old and
+ * the new value.
+ */
+static void raise_security_counter(uint32_t counter) {
+    const uint32_t *record = get_info_record();
+    size_t first_index =
+            get_info_word_index(PFB_ADDR_AS_U32(__FLASH_INFO_SECURITY_COUNTER));
+    uint32_t page[FLASH_PAGE_SIZE / sizeof(uint32_t)];
+
+    counter = MIN(counter, PFB_SECURITY_COUNTER_MAX);
+    if (!record || counter <= get_security_counter()) {
+        return;
+    }
+
+    // programming the bytes of an erased value does not change the flash
+    memset(page, 0xFF, sizeof(page));
+    get_security_counter_words(counter, &page[first_index]);
+
+    uint64_t start_us = time_us_64();
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    flash_range_program((uint32_t) record - XIP_BASE, (const uint8_t *) page,
+                        FLASH_PAGE_SIZE);
+    restore_interrupts(saved_interrupts);
+
+    if (g_boot_stats) {
+        g_boot_stats->metadata_time_us += get_elapsed_time_us(start_us);
+    }
 }
 
 static void
-overwrite_4_bytes_in_flash_isr_unsafe(uint32_t dest_addr_with_xip_offset,
-                                      uint32_t data) {
-    uint8_t data_arr_u8[FLASH_SECTOR_SIZE] = {};
-    uint32_t *data_ptr_u32 = (uint32_t *) data_arr_u8;
-    uint32_t erase_start_addr_with_xip_offset =
-            PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_INFO_START);
+overwrite_words_in_flash_isr_unsafe(const pfb_flash_info_word_t *words,
+                                    size_t words_count) {
+    uint32_t record[FLASH_PAGE_SIZE / sizeof(uint32_t)];
+    uint32_t flash_info_start_addr = PFB_ADDR_AS_U32(__FLASH_INFO_START);
+    uint32_t alternate_start_addr =
+            PFB_ADDR_AS_U32(__FLASH_INFO_ALTERNATE_START);
+    size_t sequence_index =
+            get_info_word_index(PFB_ADDR_AS_U32(__FLASH_INFO_SEQUENCE));
+    size_t checksum_index =
+            get_info_word_index(PFB_ADDR_AS_U32(__FLASH_INFO_CHECKSUM));
+    size_t should_rollback_index =
+            get_info_word_index(PFB_ADDR_AS_U32(__FLASH_INFO_SHOULD_ROLLBACK));
+    uint32_t trial_boots_addr = PFB_ADDR_AS_U32(__FLASH_INFO_TRIAL_BOOTS);
+    size_t trial_boots_index = get_info_word_index(trial_boots_addr);
+    const uint32_t *current_record = get_info_record();
+    bool are_trial_boots_overwritten = false;
 
-    assert(dest_addr_with_xip_offset >= erase_start_addr_with_xip_offset);
+    memset(record, 0xFF, sizeof(record));
+    for (size_t i = 0; i < checksum_index; i++) {
+        record[i] = read_info_word(flash_info_start_addr
+                                   + i * sizeof(uint32_t));
+    }
+    bool was_firmware_uncommitted =
+            record[should_rollback_index] == PFB_SHOULD_ROLLBACK_MAGIC;
 
-    void *flash_info_start_addr =
-            (void *) (PFB_ADDR_AS_U32(__FLASH_INFO_START));
-    memcpy(data_arr_u8, flash_info_start_addr, FLASH_SECTOR_SIZE);
+    for (size_t i = 0; i < words_count; i++) {
+        assert((words[i].dest_addr >= flash_info_start_addr
+                && words[i].dest_addr
+                           < PFB_ADDR_AS_U32(__FLASH_INFO_SEQUENCE))
+               || words[i].dest_addr == trial_boots_addr);
 
-    size_t array_index =
-            (dest_addr_with_xip_offset - erase_start_addr_with_xip_offset)
-            / (sizeof(uint32_t));
-    data_ptr_u32[array_index] = data;
+        record[get_info_word_index(words[i].dest_addr)] = words[i].data;
+        if (words[i].dest_addr == trial_boots_addr) {
+            are_trial_boots_overwritten = true;
+        }
+    }
+    record[sequence_index]++;
+    record[checksum_index] = calculate_checksum(record, checksum_index);
 
-    erase_flash_info_partition_isr_unsafe();
-    flash_range_program(erase_start_addr_with_xip_offset, data_arr_u8,
-                        FLASH_SECTOR_SIZE);
+    // the trial boots are counted since the firmware has been swapped, so they
+    // are carried over until the firmware is committed or rolled back
+    if (!are_trial_boots_overwritten && was_firmware_uncommitted
+        && record[should_rollback_index] == PFB_SHOULD_ROLLBACK_MAGIC) {
+        record[trial_boots_index] = current_record[trial_boots_index];
+    }
+    get_security_counter_words(
+            get_security_counter(),
+            &record[get_info_word_index(
+                    PFB_ADDR_AS_U32(__FLASH_INFO_SECURITY_COUNTER))]);
+
+    uint32_t current_record_addr = (uint32_t) current_record;
+    uint32_t sector_addr = current_record_addr >= alternate_start_addr
+                                   ? alternate_start_addr
+                                   : flash_info_start_addr;
+    uint32_t record_addr = get_free_record_addr(sector_addr, FLASH_PAGE_SIZE);
+    if (!record_addr) {
+        // the sector is full, so the record is written into the other one,
+        // which is erased first; the current record stays intact meanwhile
+        record_addr = sector_addr == flash_info_start_addr
+                              ? alternate_start_addr
+                              : flash_info_start_addr;
+        count_sector_erases(record_addr, FLASH_SECTOR_SIZE);
+        flash_range_erase(record_addr - XIP_BASE, FLASH_SECTOR_SIZE);
+    }
+    flash_range_program(record_addr - XIP_BASE, (const uint8_t *) record,
+                        FLASH_PAGE_SIZE);
+}
+
+static bool are_words_in_flash(const pfb_flash_info_word_t *words,
+                               size_t words_count) {
+    for (size_t i = 0; i < words_count; i++) {
+        if (read_info_word(words[i].dest_addr) != words[i].data) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Overwrites all of the @p words by appending a single record to the flash info
+ * partition, or by clearing the bits of the current record if only the flags
+ * are cleared. The partition is not written at all if it already contains the
+ * same values, which is the case during most of the boots.
+ */
+static void stage_info_words(const pfb_flash_info_word_t *words,
+                             size_t words_count) {
+    for (size_t i = 0; i < words_count; i++) {
+        size_t index = 0;
+
+        while (index < g_info_transaction.words_count
+               && g_info_transaction.words[index].dest_addr
+                          != words[i].dest_addr) {
+            index++;
+        }
+        assert(index < count_of(g_info_transaction.words));
+
+        g_info_transaction.words[index] = words[i];
+        g_info_transaction.words_count =
+                MAX(g_info_transaction.words_count, index + 1);
+    }
+}
+
+static void overwrite_words_in_flash(const pfb_flash_info_word_t *words,
+                                     size_t words_count) {
+    if (g_info_transaction.is_open) {
+        stage_info_words(words, words_count);
+        return;
+    }
+    if (are_words_in_flash(words, words_count)) {
+        return;
+    }
+
+    uint64_t start_us = time_us_64();
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    if (!clear_flags_in_place_isr_unsafe(words, words_count)) {
+        overwrite_words_in_flash_isr_unsafe(words, words_count);
+    }
+    restore_interrupts(saved_interrupts);
+
+    if (g_boot_stats) {
+        g_boot_stats->metadata_time_us += get_elapsed_time_us(start_us);
+    }
+    if (!g_wear_stats.is_store_deferred) {
+        store_wear_stats();
+    }
+}
+
+static void begin_info_transaction(void) {
+    g_info_transaction.is_open = true;
+    g_info_transaction.words_count = 0;
+}
+
+static void commit_info_transaction(void) {
+    g_info_transaction.is_open = false;
+    overwrite_words_in_flash(g_info_transaction.words,
+                             g_info_transaction.words_count);
+    g_info_transaction.words_count = 0;
 }
 
 static void overwrite_4_bytes_in_flash(uint32_t dest_addr, uint32_t data) {
+    pfb_flash_info_word_t word = {
+        .dest_addr = dest_addr,
+        .data = data
+    };
+
+    overwrite_words_in_flash(&word, 1);
+}
+
+static void mark_download_slot(uint32_t magic) {
+    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID);
+
+    overwrite_4_bytes_in_flash(dest_addr, magic);
+}
+
+static void notify_pico_about_firmware(uint32_t magic) {
+    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_FIRMWARE_SWAPPED);
+
+    overwrite_4_bytes_in_flash(dest_addr, magic);
+}
+
+#ifndef PFB_WITH_OVERWRITE_ONLY_UPDATE
+static void mark_if_should_rollback(uint32_t magic) {
+    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_SHOULD_ROLLBACK);
+
+    overwrite_4_bytes_in_flash(dest_addr, magic);
+}
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+
+static void read_image_descriptor(uint32_t descriptor_addr,
+                                  uint32_t length_addr,
+                                  pfb_image_descriptor_t *out_descriptor) {
+    uint32_t words[PFB_INFO_DESCRIPTOR_WORDS_COUNT];
+    pfb_info_image_descriptor_t descriptor;
+
+    for (size_t i = 0; i < count_of(words); i++) {
+        words[i] = read_info_word(descriptor_addr + i * sizeof(uint32_t));
+    }
+    memcpy(&descriptor, words, sizeof(descriptor));
+
+    out_descriptor->length = read_info_word(length_addr);
+    out_descriptor->version = descriptor.version;
+    out_descriptor->build_id = descriptor.build_id;
+    out_descriptor->flags = descriptor.flags;
+    out_descriptor->security_counter = descriptor.security_counter;
+    memcpy(out_descriptor->sha256, descriptor.sha256,
+           sizeof(out_descriptor->sha256));
+}
+
+static void get_image_descriptor_words(const pfb_image_descriptor_t *descriptor,
+                                       uint32_t descriptor_addr,
+                                       pfb_flash_info_word_t *out_words) {
+    uint32_t words[PFB_INFO_DESCRIPTOR_WORDS_COUNT];
+    pfb_info_image_descriptor_t info_descriptor = {
+        .version = descriptor->version,
+        .build_id = descriptor->build_id,
+        .flags = descriptor->flags,
+        .security_counter = descriptor->security_counter
+    };
+
+    memcpy(info_descriptor.sha256, descriptor->sha256,
+           sizeof(info_descriptor.sha256));
+    memcpy(words, &info_descriptor, sizeof(words));
+
+    for (size_t i = 0; i < count_of(words); i++) {
+        out_words[i].dest_addr = descriptor_addr + i * sizeof(uint32_t);
+        out_words[i].data = words[i];
+    }
+}
+
+/**
+ * Overwrites the descriptors of both of the slots. Both of the source
+ * descriptors are read before any of them is overwritten, so they can be
+ * swapped.
+ */
+static void overwrite_image_descriptors(uint32_t app_source_addr,
+                                        uint32_t download_source_addr) {
+    pfb_flash_info_word_t words[2 * PFB_INFO_DESCRIPTOR_WORDS_COUNT];
+
+    for (size_t i = 0; i < PFB_INFO_DESCRIPTOR_WORDS_COUNT; i++) {
+        uint32_t offset = i * sizeof(uint32_t);
+
+        words[2 * i] = (pfb_flash_info_word_t) {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_APP_DESCRIPTOR) + offset,
+            .data = read_info_word(app_source_addr + offset)
+        };
+        words[2 * i + 1] = (pfb_flash_info_word_t) {
+            .dest_addr =
+                    PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_DESCRIPTOR) + offset,
+            .data = read_info_word(download_source_addr + offset)
+        };
+    }
+    overwrite_words_in_flash(words, count_of(words));
+}
+
+static bool is_flash_sector_erased(uint32_t addr) {
+    // read through the non-caching alias, so scanning big flash areas does not
+    // evict the executed code from the XIP cache
+    return is_erased((const void *) (addr - XIP_BASE
+                                     + XIP_NOCACHE_NOALLOC_BASE),
+                     FLASH_SECTOR_SIZE);
+}
+
+static void erase_flash_range(uint32_t addr, size_t len) {
+    if (!len) {
+        return;
+    }
+
+    uint64_t start_us = time_us_64();
+
+    count_sector_erases(addr, len);
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    flash_range_erase(addr - XIP_BASE, len);
+    restore_interrupts(saved_interrupts);
+
+    if (g_boot_stats) {
+        uint32_t erase_time_us = get_elapsed_time_us(start_us);
+        uint32_t sectors_count = len / FLASH_SECTOR_SIZE;
+
+        g_boot_stats->erase_time_us += erase_time_us;
+        g_boot_stats->erased_sectors += sectors_count;
+        g_boot_stats->max_sector_erase_time_us =
+                MAX(g_boot_stats->max_sector_erase_time_us,
+                    erase_time_us / sectors_count);
+    }
+}
+
+static void program_flash_range(uint32_t addr, const uint8_t *src, size_t len) {
+    if (!len) {
+        return;
+    }
+
+    uint64_t start_us = time_us_64();
+
     uint32_t saved_interrupts = save_and_disable_interrupts();
-    overwrite_4_bytes_in_flash_isr_unsafe(dest_addr - XIP_BASE, data);
+    flash_range_program(addr - XIP_BASE, src, len);
     restore_interrupts(saved_interrupts);
+
+    if (g_boot_stats) {
+        g_boot_stats->program_time_us += get_elapsed_time_us(start_us);
+        g_boot_stats->programmed_pages += len / FLASH_PAGE_SIZE;
+    }
 }
 
-static void mark_download_slot(uint32_t magic) {
-    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID);
+/**
+ * Erases the flash range sector by sector, skipping the sectors that are
+ * already erased. Consecutive sectors are erased using a single call, so the
+ * ROM routine can still use 64k block erases where possible.
+ */
+static void erase_flash_range_skipping_erased_sectors(uint32_t addr,
+                                                      size_t len) {
+    uint32_t range_start = addr;
+    uint32_t range_end = addr + len;
 
-    overwrite_4_bytes_in_flash(dest_addr, magic);
+    for (uint32_t sector = addr; sector < range_end;
+         sector += FLASH_SECTOR_SIZE) {
+        if (is_flash_sector_erased(sector)) {
+            erase_flash_range(range_start, sector - range_start);
+            range_start = sector + FLASH_SECTOR_SIZE;
+        }
+    }
+    erase_flash_range(range_start, range_end - range_start);
 }
 
-static void notify_pico_about_firmware(uint32_t magic) {
-    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_FIRMWARE_SWAPPED);
+/**
+ * Programs the flash range, skipping the pages of @p src that contain only
+ * erased (0xFF) bytes. The destination MUST be already erased.
+ */
+static void program_flash_range_skipping_erased_pages(uint32_t addr,
+                                                      const uint8_t *src,
+                                                      size_t len) {
+    size_t range_start = 0;
 
-    overwrite_4_bytes_in_flash(dest_addr, magic);
+    for (size_t page = 0; page < len; page += FLASH_PAGE_SIZE) {
+        if (is_erased(src + page, FLASH_PAGE_SIZE)) {
+            program_flash_range(addr + range_start, src + range_start,
+                                page - range_start);
+            range_start = page + FLASH_PAGE_SIZE;
+        }
+    }
+    program_flash_range(addr + range_start, src + range_start,
+                        len - range_start);
 }
 
-static void mark_if_should_rollback(uint32_t magic) {
-    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_SHOULD_ROLLBACK);
+/**
+ * Returns the start address of the slot the application is executed from. If
+ * PFB_WITH_DIRECT_XIP is defined, the slots are switched after every update
+ * and rollback, otherwise it's always the application slot.
+ */
+static uint32_t get_app_slot_addr(void) {
+#ifdef PFB_WITH_DIRECT_XIP
+    if (read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_APP_HEADER))
+        == PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START)) {
+        return PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START);
+    }
+#endif // PFB_WITH_DIRECT_XIP
+    return PFB_ADDR_AS_U32(__FLASH_APP_START);
+}
 
-    overwrite_4_bytes_in_flash(dest_addr, magic);
+/**
+ * Returns the start address of the slot the new image is downloaded into, i.e.
+ * the one the application is not executed from.
+ */
+static uint32_t get_download_slot_addr(void) {
+    return get_app_slot_addr() == PFB_ADDR_AS_U32(__FLASH_APP_START)
+                   ? PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START)
+                   : PFB_ADDR_AS_U32(__FLASH_APP_START);
 }
 
-static void mark_if_is_after_rollback(uint32_t magic) {
-    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_AFTER_ROLLBACK);
+/**
+ * Returns the number of boots of the uncommitted firmware, including the
+ * current one. The first boot after the swap is not marked, as the bootloader
+ * jumps to the new firmware right after swapping the images.
+ */
+static uint32_t get_trial_boots_count(void) {
+    const uint32_t *record = get_info_record();
 
-    overwrite_4_bytes_in_flash(dest_addr, magic);
+    if (!record) {
+        return 0;
+    }
+    return 1
+           + __builtin_popcount(~record[get_info_word_index(
+                   PFB_ADDR_AS_U32(__FLASH_INFO_TRIAL_BOOTS))]);
 }
 
 static void *get_image_sha256_address(size_t image_size) {
-    return (void *) (PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START) + image_size
+    return (void *) (get_download_slot_addr() + image_size
                      - PFB_SHA256_DIGEST_SIZE);
 }
 
@@ -139,8 +1007,137 @@ static int decrypt_256_bytes(const uint8_t *src, uint8_t *out_dest) {
 }
 #endif // PFB_WITH_IMAGE_ENCRYPTION
 
-void pfb_mark_download_slot_as_valid(void) {
-    mark_download_slot(PFB_SHOULD_SWAP_MAGIC);
+static uint32_t get_app_image_security_counter(void) {
+    return read_info_word(
+            PFB_ADDR_AS_U32(__FLASH_INFO_APP_DESCRIPTOR)
+            + offsetof(pfb_info_image_descriptor_t, security_counter));
+}
+
+static bool is_image_length_valid(size_t image_size_bytes) {
+    return image_size_bytes && !(image_size_bytes % PFB_ALIGN_SIZE)
+           && image_size_bytes
+                      <= (size_t) PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH);
+}
+
+#if defined(PFB_WITH_IMAGE_COMPRESSION) \
+        && !defined(PFB_WITH_OVERWRITE_ONLY_UPDATE)
+static uint32_t align_to_sector_size(uint32_t length) {
+    return (length + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE
+           * FLASH_SECTOR_SIZE;
+}
+
+/**
+ * Returns the length of the current image that has to be kept for the
+ * rollback. If the length is unknown, all of the sectors up to the last
+ * non-erased one are kept.
+ */
+static uint32_t get_app_image_backup_length(void) {
+    uint32_t app_image_length =
+            read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_APP_IMAGE_LENGTH));
+
+    if (app_image_length) {
+        return align_to_sector_size(app_image_length);
+    }
+
+    for (uint32_t length = PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH); length;
+         length -= FLASH_SECTOR_SIZE) {
+        if (!is_flash_sector_erased(PFB_ADDR_AS_U32(__FLASH_APP_START) + length
+                                    - FLASH_SECTOR_SIZE)) {
+            return length;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The bootloader moves the compressed file to the end of the download slot and
+ * backs the current image up at its beginning, so both of them have to fit in
+ * the slot, next to the file kept at its original place.
+ */
+static bool is_compressed_file_length_valid(uint32_t file_length) {
+    uint32_t aligned_file_length = align_to_sector_size(file_length);
+
+    return MAX(aligned_file_length, get_app_image_backup_length())
+                   + aligned_file_length
+           <= PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH);
+}
+#endif
+
+/**
+ * Checks if the described image can be installed in place of the current one,
+ * i.e. if its length is valid and, if it's compressed, if there is enough
+ * room to unpack it.
+ */
+static bool does_image_fit(const pfb_image_descriptor_t *descriptor) {
+    if (!is_image_length_valid(descriptor->length)) {
+        return false;
+    }
+#if defined(PFB_WITH_IMAGE_COMPRESSION) \
+        && !defined(PFB_WITH_OVERWRITE_ONLY_UPDATE)
+    if (descriptor->flags & PFB_IMAGE_FLAG_COMPRESSED) {
+        return is_compressed_file_length_valid(descriptor->length);
+    }
+#endif
+    return true;
+}
+
+int pfb_mark_download_slot_as_valid(size_t image_size_bytes) {
+    if (!is_image_length_valid(image_size_bytes)) {
+        return 1;
+    }
+
+    pfb_image_descriptor_t descriptor = {
+        .length = (uint32_t) image_size_bytes
+    };
+#ifdef PFB_WITH_IMAGE_ENCRYPTION
+    descriptor.flags |= PFB_IMAGE_FLAG_ENCRYPTED;
+#endif // PFB_WITH_IMAGE_ENCRYPTION
+#ifdef PFB_WITH_IMAGE_COMPRESSION
+    descriptor.flags |= PFB_IMAGE_FLAG_COMPRESSED;
+#endif // PFB_WITH_IMAGE_COMPRESSION
+#ifdef PFB_WITH_SHA256_HASHING
+    memcpy(descriptor.sha256, get_image_sha256_address(image_size_bytes),
+           sizeof(descriptor.sha256));
+#endif // PFB_WITH_SHA256_HASHING
+
+    return pfb_mark_download_slot_as_valid_with_descriptor(&descriptor);
+}
+
+int pfb_mark_download_slot_as_valid_with_descriptor(
+        const pfb_image_descriptor_t *descriptor) {
+    if (!does_image_fit(descriptor)
+        || descriptor->security_counter < get_security_counter()) {
+        return 1;
+    }
+
+    pfb_flash_info_word_t words[2 + PFB_INFO_DESCRIPTOR_WORDS_COUNT] = {
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_IMAGE_LENGTH),
+            .data = descriptor->length
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID),
+            .data = PFB_SHOULD_SWAP_MAGIC
+        }
+    };
+    get_image_descriptor_words(
+            descriptor, PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_DESCRIPTOR),
+            &words[2]);
+    overwrite_words_in_flash(words, count_of(words));
+
+    return 0;
+}
+
+void pfb_get_app_image_descriptor(pfb_image_descriptor_t *out_descriptor) {
+    read_image_descriptor(PFB_ADDR_AS_U32(__FLASH_INFO_APP_DESCRIPTOR),
+                          PFB_ADDR_AS_U32(__FLASH_INFO_APP_IMAGE_LENGTH),
+                          out_descriptor);
+}
+
+void pfb_get_download_image_descriptor(pfb_image_descriptor_t *out_descriptor) {
+    read_image_descriptor(PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_DESCRIPTOR),
+                          PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_IMAGE_LENGTH),
+                          out_descriptor);
 }
 
 void pfb_mark_download_slot_as_invalid(void) {
@@ -148,7 +1145,8 @@ void pfb_mark_download_slot_as_invalid(void) {
 }
 
 bool pfb_is_after_firmware_update(void) {
-    return (__FLASH_INFO_IS_FIRMWARE_SWAPPED == PFB_HAS_NEW_FIRMWARE_MAGIC);
+    return read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_IS_FIRMWARE_SWAPPED))
+           == PFB_HAS_NEW_FIRMWARE_MAGIC;
 }
 
 int pfb_write_to_flash_aligned_256_bytes(uint8_t *src,
@@ -156,7 +1154,7 @@ int pfb_write_to_flash_aligned_256_bytes(uint8_t *src,
                                          size_t len_bytes) {
     if (len_bytes % PFB_ALIGN_SIZE || offset_bytes % PFB_ALIGN_SIZE
         || offset_bytes + len_bytes
-                   > (size_t) PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH)) {
+                   > (size_t) PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH)) {
         return 1;
     }
 
@@ -168,9 +1166,8 @@ int pfb_write_to_flash_aligned_256_bytes(uint8_t *src,
             return ret;
         }
 #endif // PFB_WITH_IMAGE_ENCRYPTION
-        uint32_t dest_address =
-                PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_DOWNLOAD_SLOT_START)
-                + offset_bytes + i * PFB_ALIGN_SIZE;
+        uint32_t dest_address = get_download_slot_addr() - XIP_BASE
+                                + offset_bytes + i * PFB_ALIGN_SIZE;
         uint8_t *src_address =
 #ifdef PFB_WITH_IMAGE_ENCRYPTION
                 output_aes_dec;
@@ -184,17 +1181,30 @@ int pfb_write_to_flash_aligned_256_bytes(uint8_t *src,
     return 0;
 }
 
+int pfb_initialize_download_slot_with_descriptor(
+        const pfb_image_descriptor_t *descriptor) {
+    // checked before committing and erasing anything, so the rejected image
+    // costs neither the download nor an erase; committing raises the counter
+    // to the application's one, so that one is not allowed either
+    uint32_t min_security_counter =
+            MAX(get_security_counter(), get_app_image_security_counter());
+
+    if (!does_image_fit(descriptor)
+        || descriptor->security_counter < min_security_counter) {
+        return 1;
+    }
+    return pfb_initialize_download_slot();
+}
+
 int pfb_initialize_download_slot(void) {
-    uint32_t erase_len = PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH);
-    uint32_t erase_address_with_xip_offset =
-            PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_DOWNLOAD_SLOT_START);
+    uint32_t erase_len = PFB_ADDR_AS_U32(__FLASH_IMAGE_MAX_LENGTH);
     assert(erase_len % FLASH_SECTOR_SIZE == 0);
 
     pfb_firmware_commit();
 
-    uint32_t saved_interrupts = save_and_disable_interrupts();
-    flash_range_erase(erase_address_with_xip_offset, erase_len);
-    restore_interrupts(saved_interrupts);
+    erase_flash_range_skipping_erased_sectors(get_download_slot_addr(),
+                                              erase_len);
+    store_wear_stats();
 
 #ifdef PFB_WITH_IMAGE_ENCRYPTION
     mbedtls_aes_free(&g_aes_ctx);
@@ -210,20 +1220,259 @@ int pfb_initialize_download_slot(void) {
 }
 
 void pfb_perform_update(void) {
+    pfb_reboot(0);
+}
+
+void pfb_reboot(uint32_t commands) {
 #ifdef PFB_WITH_IMAGE_ENCRYPTION
     mbedtls_aes_free(&g_aes_ctx);
 #endif // PFB_WITH_IMAGE_ENCRYPTION
+    watchdog_hw->scratch[PFB_BOOT_COMMANDS_SCRATCH] = commands;
+    watchdog_hw->scratch[PFB_BOOT_COMMANDS_CHECKSUM_SCRATCH] =
+            0 - (PFB_BOOT_COMMANDS_MAGIC + commands);
+    watchdog_hw->scratch[PFB_BOOT_COMMANDS_MAGIC_SCRATCH] =
+            PFB_BOOT_COMMANDS_MAGIC;
     watchdog_enable(1, 1);
     while (1)
         ;
 }
 
 void pfb_firmware_commit(void) {
+#ifndef PFB_WITH_OVERWRITE_ONLY_UPDATE
     mark_if_should_rollback(PFB_SHOULD_NOT_ROLLBACK_MAGIC);
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+    // raised only once the firmware is committed, so the previous firmware can
+    // still be rolled back to
+    raise_security_counter(get_app_image_security_counter());
+}
+
+uint32_t pfb_get_security_counter(void) {
+    return get_security_counter();
 }
 
 bool pfb_is_after_rollback(void) {
-    return (__FLASH_INFO_IS_AFTER_ROLLBACK == PFB_IS_AFTER_ROLLBACK_MAGIC);
+#ifdef PFB_WITH_OVERWRITE_ONLY_UPDATE
+    return false;
+#else  // PFB_WITH_OVERWRITE_ONLY_UPDATE
+    return read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_IS_AFTER_ROLLBACK))
+           == PFB_IS_AFTER_ROLLBACK_MAGIC;
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+}
+
+uint32_t pfb_get_remaining_boot_attempts(void) {
+#ifdef PFB_WITH_OVERWRITE_ONLY_UPDATE
+    return 0;
+#else  // PFB_WITH_OVERWRITE_ONLY_UPDATE
+    if (read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_SHOULD_ROLLBACK))
+        != PFB_SHOULD_ROLLBACK_MAGIC) {
+        return 0;
+    }
+
+    uint32_t trial_boots_count = get_trial_boots_count();
+    return trial_boots_count < PFB_TRIAL_BOOTS_COUNT
+                   ? PFB_TRIAL_BOOTS_COUNT - trial_boots_count
+                   : 0;
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+}
+
+bool pfb_is_download_slot_image_required(void) {
+#ifdef PFB_WITH_DIRECT_XIP
+    return get_download_slot_addr()
+           == PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START);
+#else  // PFB_WITH_DIRECT_XIP
+    return false;
+#endif // PFB_WITH_DIRECT_XIP
+}
+
+uint32_t pfb_get_swap_skipped_sectors(void) {
+    if (PFB_SHARED_RAM->magic != PFB_SHARED_RAM_MAGIC) {
+        return 0;
+    }
+    return PFB_SHARED_RAM->swap_skipped_sectors;
+}
+
+static uint16_t calculate_crc16(const uint8_t *data, size_t len) {
+    uint16_t crc = 0xffff;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t) data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static void read_from_ram_log(uint32_t pos, void *dest, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        ((uint8_t *) dest)[i] =
+                PFB_SHARED_RAM->log[(pos + i) % PFB_RAM_LOG_SIZE];
+    }
+}
+
+static void write_to_ram_log(uint32_t pos, const void *src, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        PFB_SHARED_RAM->log[(pos + i) % PFB_RAM_LOG_SIZE] =
+                ((const uint8_t *) src)[i];
+    }
+}
+
+size_t pfb_read_bootloader_log(char *out_buff, size_t buff_size) {
+    if (!buff_size || PFB_SHARED_RAM->magic != PFB_SHARED_RAM_MAGIC) {
+        return 0;
+    }
+
+    uint32_t pos = PFB_SHARED_RAM->log_first;
+    uint32_t next = PFB_SHARED_RAM->log_next;
+    size_t out_len = 0;
+    if (next - pos > PFB_RAM_LOG_SIZE) {
+        next = pos;
+    }
+
+    while (next - pos >= sizeof(pfb_ram_log_record_header_t)) {
+        pfb_ram_log_record_header_t header;
+        char text[PFB_RAM_LOG_MAX_RECORD_LENGTH];
+
+        read_from_ram_log(pos, &header, sizeof(header));
+        pos += sizeof(header);
+        if (header.length > sizeof(text) || header.length > next - pos) {
+            break;
+        }
+        read_from_ram_log(pos, text, header.length);
+        pos += header.length;
+        if (calculate_crc16((const uint8_t *) text, header.length)
+                    != header.crc
+            || out_len + header.length + 1 >= buff_size) {
+            break;
+        }
+
+        memcpy(out_buff + out_len, text, header.length);
+        out_len += header.length;
+        out_buff[out_len++] = '\n';
+    }
+    out_buff[out_len] = '\0';
+
+    return out_len;
+}
+
+/**
+ * Returns the valid record of the update history with the lowest sequence
+ * number that is not lower than @p min_sequence, or the one with the highest
+ * sequence number if @p is_newest is set.
+ *
+ * @return Pointer to the record in flash, NULL if there is no such record.
+ */
+static const pfb_update_history_record_t *
+find_update_history_record(uint32_t min_sequence, bool is_newest) {
+    uint32_t history_start_addr =
+            PFB_ADDR_AS_U32(__FLASH_UPDATE_HISTORY_START);
+    uint32_t history_end_addr =
+            history_start_addr
+            + PFB_ADDR_AS_U32(__FLASH_UPDATE_HISTORY_LENGTH);
+    const pfb_update_history_record_t *found = NULL;
+
+    for (uint32_t addr = history_start_addr; addr < history_end_addr;
+         addr += sizeof(pfb_update_history_record_t)) {
+        const pfb_update_history_record_t *record =
+                (const pfb_update_history_record_t *) addr;
+
+        if (!is_checksum_valid((const uint32_t *) record,
+                               sizeof(*record) / sizeof(uint32_t))
+            || record->entry.sequence < min_sequence) {
+            continue;
+        }
+        if (!found
+            || (is_newest ? record->entry.sequence > found->entry.sequence
+                          : record->entry.sequence < found->entry.sequence)) {
+            found = record;
+        }
+    }
+    return found;
+}
+
+void pfb_init_update_history_iterator(pfb_update_history_iterator_t *iterator,
+                                      uint32_t first_sequence) {
+    iterator->next_sequence = first_sequence;
+}
+
+bool pfb_get_next_update_history_entry(pfb_update_history_iterator_t *iterator,
+                                       pfb_update_history_entry_t *out_entry) {
+    const pfb_update_history_record_t *record =
+            find_update_history_record(iterator->next_sequence, false);
+
+    if (!record) {
+        return false;
+    }
+    *out_entry = record->entry;
+    iterator->next_sequence = record->entry.sequence + 1;
+    return true;
+}
+
+static void accumulate_wear_stats(uint32_t addr,
+                                  size_t len,
+                                  pfb_wear_stats_t *stats) {
+    uint32_t first_sector_addr = PFB_ADDR_AS_U32(__FLASH_INFO_START);
+
+    for (uint32_t sector = addr; sector < addr + len;
+         sector += FLASH_SECTOR_SIZE) {
+        uint32_t erase_count =
+                g_wear_stats.record.erase_counts[(sector - first_sector_addr)
+                                                 / FLASH_SECTOR_SIZE];
+
+        stats->sectors_count++;
+        stats->total_erase_count += erase_count;
+        stats->max_erase_count = MAX(stats->max_erase_count, erase_count);
+    }
+}
+
+int pfb_get_wear_stats(pfb_flash_region_t region, pfb_wear_stats_t *out_stats) {
+    uint32_t download_slot_addr =
+            PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START);
+    uint32_t slot_length = PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH);
+    uint32_t reserved_start_addr = PFB_ADDR_AS_U32(__FLASH_RESERVED_START);
+    uint32_t alternate_info_addr =
+            PFB_ADDR_AS_U32(__FLASH_INFO_ALTERNATE_START);
+
+    memset(out_stats, 0, sizeof(*out_stats));
+    load_wear_stats();
+
+    if (region == PFB_FLASH_REGION_INFO) {
+        accumulate_wear_stats(PFB_ADDR_AS_U32(__FLASH_INFO_START),
+                              FLASH_SECTOR_SIZE, out_stats);
+        accumulate_wear_stats(PFB_ADDR_AS_U32(__FLASH_INFO_ALTERNATE_START),
+                              FLASH_SECTOR_SIZE, out_stats);
+    } else if (region == PFB_FLASH_REGION_APP_SLOT) {
+        accumulate_wear_stats(PFB_ADDR_AS_U32(__FLASH_APP_START), slot_length,
+                              out_stats);
+    } else if (region == PFB_FLASH_REGION_DOWNLOAD_SLOT) {
+        accumulate_wear_stats(download_slot_addr,
+                              reserved_start_addr - download_slot_addr,
+                              out_stats);
+    } else if (region == PFB_FLASH_REGION_RESERVED) {
+        // the alternate flash info sector is counted in PFB_FLASH_REGION_INFO
+        accumulate_wear_stats(reserved_start_addr,
+                              alternate_info_addr - reserved_start_addr,
+                              out_stats);
+        accumulate_wear_stats(alternate_info_addr + FLASH_SECTOR_SIZE,
+                              download_slot_addr + slot_length
+                                      - alternate_info_addr - FLASH_SECTOR_SIZE,
+                              out_stats);
+    } else {
+        return 1;
+    }
+
+    out_stats->average_erase_count =
+            out_stats->total_erase_count / out_stats->sectors_count;
+    return 0;
+}
+
+int pfb_get_boot_stats(pfb_boot_stats_t *out_stats) {
+    if (PFB_SHARED_RAM->magic != PFB_SHARED_RAM_MAGIC) {
+        return 1;
+    }
+
+    memcpy(out_stats, (const void *) &PFB_SHARED_RAM->boot_stats,
+           sizeof(*out_stats));
+    return 0;
 }
 
 int pfb_firmware_sha256_check(size_t firmware_size) {
@@ -241,7 +1490,7 @@ int pfb_firmware_sha256_check(size_t firmware_size) {
         return ret;
     }
 
-    uint32_t image_start_address = PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START);
+    uint32_t image_start_address = get_download_slot_addr();
     size_t image_size_without_sha256 = firmware_size - 256;
     ret = mbedtls_sha256_update_ret(&sha256_ctx,
                                     (const unsigned char *) image_start_address,
@@ -269,30 +1518,363 @@ int pfb_firmware_sha256_check(size_t firmware_size) {
     return 0;
 }
 
-void _pfb_mark_should_rollback(void) {
-    mark_if_should_rollback(PFB_SHOULD_ROLLBACK_MAGIC);
+bool _pfb_should_rollback(void) {
+#ifdef PFB_WITH_OVERWRITE_ONLY_UPDATE
+    return false;
+#else  // PFB_WITH_OVERWRITE_ONLY_UPDATE
+    return read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_SHOULD_ROLLBACK))
+           == PFB_SHOULD_ROLLBACK_MAGIC;
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
 }
 
-void _pfb_mark_is_after_rollback(void) {
-    mark_if_is_after_rollback(PFB_IS_AFTER_ROLLBACK_MAGIC);
+uint32_t _pfb_get_trial_boots_count(void) {
+    return get_trial_boots_count();
 }
 
-void _pfb_mark_is_not_after_rollback(void) {
-    mark_if_is_after_rollback(PFB_IS_NOT_AFTER_ROLLBACK_MAGIC);
-}
+void _pfb_mark_trial_boot(void) {
+    const uint32_t *record = get_info_record();
+    size_t trial_boots_index =
+            get_info_word_index(PFB_ADDR_AS_U32(__FLASH_INFO_TRIAL_BOOTS));
 
-bool _pfb_should_rollback(void) {
-    return (__FLASH_INFO_SHOULD_ROLLBACK == PFB_SHOULD_ROLLBACK_MAGIC);
-}
+    if (!record) {
+        return;
+    }
 
-bool _pfb_has_firmware_to_swap(void) {
-    return (__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID == PFB_SHOULD_SWAP_MAGIC);
+    uint64_t start_us = time_us_64();
+
+    // clears the next bit only, so a power loss during the write either
+    // counts the boot or not
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    program_record_word_isr_unsafe(record, trial_boots_index,
+                                   record[trial_boots_index] << 1);
+    restore_interrupts(saved_interrupts);
+
+    if (g_boot_stats) {
+        g_boot_stats->metadata_time_us += get_elapsed_time_us(start_us);
+    }
 }
 
-void _pfb_mark_pico_has_new_firmware(void) {
-    notify_pico_about_firmware(PFB_HAS_NEW_FIRMWARE_MAGIC);
+bool _pfb_has_firmware_to_swap(void) {
+    return read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID))
+           == PFB_SHOULD_SWAP_MAGIC;
 }
 
 void _pfb_mark_pico_has_no_new_firmware(void) {
     notify_pico_about_firmware(PFB_NO_NEW_FIRMWARE_MAGIC);
 }
+
+uint32_t _pfb_get_app_image_length(void) {
+    return read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_APP_IMAGE_LENGTH));
+}
+
+uint32_t _pfb_get_download_image_length(void) {
+    return read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_IMAGE_LENGTH));
+}
+
+uint32_t _pfb_get_app_slot_addr(void) {
+    return get_app_slot_addr();
+}
+
+uint32_t _pfb_get_download_slot_addr(void) {
+    return get_download_slot_addr();
+}
+
+uint32_t _pfb_get_swap_counter(void) {
+    return read_info_word(PFB_ADDR_AS_U32(__FLASH_INFO_SWAP_COUNTER));
+}
+
+#if defined(PFB_WITH_IMAGE_COMPRESSION) \
+        && !defined(PFB_WITH_OVERWRITE_ONLY_UPDATE)
+uint32_t _pfb_get_app_image_backup_length(void) {
+    return get_app_image_backup_length();
+}
+
+bool _pfb_is_compressed_file_length_valid(uint32_t file_length) {
+    return is_compressed_file_length_valid(file_length);
+}
+#endif
+
+#ifdef PFB_WITH_OVERWRITE_ONLY_UPDATE
+void _pfb_mark_firmware_copied(uint32_t app_image_length) {
+    pfb_flash_info_word_t words[] = {
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_APP_IMAGE_LENGTH),
+            .data = app_image_length
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_FIRMWARE_SWAPPED),
+            .data = PFB_HAS_NEW_FIRMWARE_MAGIC
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID),
+            .data = PFB_SHOULD_NOT_SWAP_MAGIC
+        }
+    };
+
+    // the downloaded image stays in the download slot, so its descriptor is
+    // only copied
+    begin_info_transaction();
+    overwrite_words_in_flash(words, count_of(words));
+    overwrite_image_descriptors(
+            PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_DESCRIPTOR),
+            PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_DESCRIPTOR));
+    commit_info_transaction();
+
+    // there is no previous firmware to roll back to, so the counter is raised
+    // without waiting for the commit
+    raise_security_counter(get_app_image_security_counter());
+}
+#else  // PFB_WITH_OVERWRITE_ONLY_UPDATE
+/**
+ * Stores the outcome of the images swap, including the swapped image
+ * descriptors, using a single write of the flash info partition. Incrementing
+ * the swap counter invalidates the swap journal, so the swap is either entirely
+ * finished or resumed after a power loss.
+ *
+ * If @p is_invalid is true, the new image has failed the verification, so the
+ * same write uses up its trial boots. The revert interrupted by a power loss
+ * is then resumed as an ordinary rollback instead of booting the image.
+ */
+static void mark_images_swapped(bool is_rollback,
+                                bool is_invalid,
+                                uint32_t app_image_length,
+                                uint32_t download_image_length) {
+    pfb_flash_info_word_t words[] = {
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_APP_IMAGE_LENGTH),
+            .data = app_image_length
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_IMAGE_LENGTH),
+            .data = download_image_length
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_FIRMWARE_SWAPPED),
+            .data = is_rollback ? PFB_NO_NEW_FIRMWARE_MAGIC
+                                : PFB_HAS_NEW_FIRMWARE_MAGIC
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_AFTER_ROLLBACK),
+            .data = is_rollback ? PFB_IS_AFTER_ROLLBACK_MAGIC
+                                : PFB_IS_NOT_AFTER_ROLLBACK_MAGIC
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_SHOULD_ROLLBACK),
+            .data = is_rollback ? PFB_SHOULD_NOT_ROLLBACK_MAGIC
+                                : PFB_SHOULD_ROLLBACK_MAGIC
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID),
+            .data = PFB_SHOULD_NOT_SWAP_MAGIC
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_SWAP_COUNTER),
+            .data = _pfb_get_swap_counter() + 1
+        },
+#ifdef PFB_WITH_DIRECT_XIP
+        // the images are executed in place, so only the slots are switched
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_APP_HEADER),
+            .data = get_download_slot_addr()
+        },
+        {
+            .dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_HEADER),
+            .data = get_app_slot_addr()
+        },
+#endif // PFB_WITH_DIRECT_XIP
+    };
+
+    begin_info_transaction();
+    overwrite_words_in_flash(words, count_of(words));
+    if (is_invalid) {
+        overwrite_4_bytes_in_flash(PFB_ADDR_AS_U32(__FLASH_INFO_TRIAL_BOOTS),
+                                   0);
+    }
+    overwrite_image_descriptors(
+            PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_DESCRIPTOR),
+            PFB_ADDR_AS_U32(__FLASH_INFO_APP_DESCRIPTOR));
+    commit_info_transaction();
+}
+
+void _pfb_mark_firmware_swapped(bool is_invalid) {
+    mark_images_swapped(false, is_invalid, _pfb_get_download_image_length(),
+                        _pfb_get_app_image_length());
+}
+
+void _pfb_mark_firmware_unpacked(uint32_t app_image_length,
+                                 uint32_t download_image_length,
+                                 bool is_invalid) {
+    mark_images_swapped(false, is_invalid, app_image_length,
+                        download_image_length);
+}
+
+void _pfb_mark_firmware_rolled_back(void) {
+    mark_images_swapped(true, false, _pfb_get_download_image_length(),
+                        _pfb_get_app_image_length());
+}
+#endif // PFB_WITH_OVERWRITE_ONLY_UPDATE
+
+void _pfb_start_image_hashing(void) {
+#ifdef PFB_WITH_SHA256_HASHING
+    mbedtls_sha256_init(&g_image_sha256_ctx);
+    g_image_sha256_ret = mbedtls_sha256_starts_ret(&g_image_sha256_ctx, 0);
+#endif // PFB_WITH_SHA256_HASHING
+}
+
+void _pfb_update_image_hash(const uint8_t *data, size_t len) {
+#ifdef PFB_WITH_SHA256_HASHING
+    if (!g_image_sha256_ret) {
+        g_image_sha256_ret =
+                mbedtls_sha256_update_ret(&g_image_sha256_ctx, data, len);
+    }
+#endif // PFB_WITH_SHA256_HASHING
+    (void) data;
+    (void) len;
+}
+
+bool _pfb_is_image_hash_valid(const uint8_t *image_sha256) {
+#ifdef PFB_WITH_SHA256_HASHING
+    unsigned char calculated_sha256[PFB_SHA256_DIGEST_SIZE];
+
+    if (!g_image_sha256_ret) {
+        g_image_sha256_ret = mbedtls_sha256_finish_ret(&g_image_sha256_ctx,
+                                                       calculated_sha256);
+    }
+    mbedtls_sha256_free(&g_image_sha256_ctx);
+
+    if (g_image_sha256_ret
+        || memcmp(calculated_sha256, image_sha256, PFB_SHA256_DIGEST_SIZE)
+                   != 0) {
+        return false;
+    }
+#endif // PFB_WITH_SHA256_HASHING
+    (void) image_sha256;
+
+    return true;
+}
+
+pfb_boot_stats_t *_pfb_initialize_shared_ram(void) {
+    PFB_SHARED_RAM->swap_skipped_sectors = 0;
+    memset((void *) &PFB_SHARED_RAM->boot_stats, 0,
+           sizeof(PFB_SHARED_RAM->boot_stats));
+    PFB_SHARED_RAM->log_first = 0;
+    PFB_SHARED_RAM->log_next = 0;
+    PFB_SHARED_RAM->magic = PFB_SHARED_RAM_MAGIC;
+
+    g_boot_stats = (pfb_boot_stats_t *) &PFB_SHARED_RAM->boot_stats;
+    g_wear_stats.is_store_deferred = true;
+    return g_boot_stats;
+}
+
+void _pfb_log_to_ram(const char *format, ...) {
+    char text[PFB_RAM_LOG_MAX_RECORD_LENGTH + 1];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+
+    pfb_ram_log_record_header_t header = {
+        .length = (uint16_t) MIN((size_t) len, sizeof(text) - 1),
+    };
+    header.crc = calculate_crc16((const uint8_t *) text, header.length);
+    uint32_t record_length = sizeof(header) + header.length;
+
+    // the oldest records are dropped to make room for the new one
+    uint32_t next = PFB_SHARED_RAM->log_next;
+    while (next + record_length - PFB_SHARED_RAM->log_first
+           > PFB_RAM_LOG_SIZE) {
+        pfb_ram_log_record_header_t oldest;
+        read_from_ram_log(PFB_SHARED_RAM->log_first, &oldest, sizeof(oldest));
+        PFB_SHARED_RAM->log_first += sizeof(oldest) + oldest.length;
+    }
+
+    write_to_ram_log(next, &header, sizeof(header));
+    write_to_ram_log(next + sizeof(header), text, header.length);
+    PFB_SHARED_RAM->log_next = next + record_length;
+}
+
+void _pfb_add_update_history_entry(const pfb_update_history_entry_t *entry) {
+    const pfb_update_history_record_t *newest =
+            find_update_history_record(0, true);
+    pfb_update_history_record_t record = {
+        .entry = *entry
+    };
+
+    record.entry.sequence = newest ? newest->entry.sequence + 1 : 1;
+    uint64_t start_us = time_us_64();
+
+    append_checksummed_record(PFB_ADDR_AS_U32(__FLASH_UPDATE_HISTORY_START),
+                              newest, &record, sizeof(record),
+                              &record.checksum);
+
+    if (g_boot_stats) {
+        g_boot_stats->metadata_time_us += get_elapsed_time_us(start_us);
+    }
+}
+
+uint32_t _pfb_consume_boot_commands(void) {
+    uint32_t magic = watchdog_hw->scratch[PFB_BOOT_COMMANDS_MAGIC_SCRATCH];
+    uint32_t commands = watchdog_hw->scratch[PFB_BOOT_COMMANDS_SCRATCH];
+    uint32_t checksum =
+            watchdog_hw->scratch[PFB_BOOT_COMMANDS_CHECKSUM_SCRATCH];
+
+    // the commands apply only to a single boot, so a crash of the application
+    // does not repeat them
+    watchdog_hw->scratch[PFB_BOOT_COMMANDS_MAGIC_SCRATCH] = 0;
+
+    if (magic != PFB_BOOT_COMMANDS_MAGIC || magic + commands + checksum != 0) {
+        return 0;
+    }
+    return commands;
+}
+
+void _pfb_initialize_info_partition(void) {
+    const uint32_t *first_record =
+            (const uint32_t *) PFB_ADDR_AS_U32(__FLASH_INFO_START);
+    size_t sequence_index =
+            get_info_word_index(PFB_ADDR_AS_U32(__FLASH_INFO_SEQUENCE));
+
+    // only the record programmed together with the bootloader has the sequence
+    // number 0, so the partition has just been flashed and the records left in
+    // the alternate sector by the previous installation have to be dropped
+    if (is_info_record_valid(first_record) && first_record[sequence_index] == 0
+        && is_erased(first_record + FLASH_PAGE_SIZE / sizeof(uint32_t),
+                     FLASH_PAGE_SIZE)
+        && !is_flash_sector_erased(
+                PFB_ADDR_AS_U32(__FLASH_INFO_ALTERNATE_START))) {
+        erase_flash_range(PFB_ADDR_AS_U32(__FLASH_INFO_ALTERNATE_START),
+                          FLASH_SECTOR_SIZE);
+    }
+}
+
+void _pfb_begin_info_transaction(void) {
+    begin_info_transaction();
+}
+
+void _pfb_commit_info_transaction(void) {
+    commit_info_transaction();
+}
+
+void _pfb_store_wear_stats(void) {
+    store_wear_stats();
+}
+
+void _pfb_set_swap_skipped_sectors(uint32_t skipped_sectors) {
+    PFB_SHARED_RAM->swap_skipped_sectors = skipped_sectors;
+}
+
+bool _pfb_is_flash_sector_erased(uint32_t addr) {
+    return is_flash_sector_erased(addr);
+}
+
+void _pfb_erase_flash_range(uint32_t addr, size_t len) {
+    erase_flash_range_skipping_erased_sectors(addr, len);
+}
+
+void _pfb_program_flash_range(uint32_t addr, const uint8_t *src, size_t len) {
+    program_flash_range_skipping_erased_pages(addr, src, len);
+}